@@ -6,6 +6,11 @@ PROJECT_DIR="$(pwd)"
 LAMAC="${LAMAC:-$PROJECT_DIR/Lama/src/lamac}"
 TESTS_DIR="${TESTS_DIR:-regression}"
 LAMA_INTERPRETER="${LAMA_INTERPRETER:-$PROJECT_DIR/lama-interpreter}"
+# Every test also runs with each of these environments, a tiny heap under each collector
+GC_MODES="${GC_MODES-LAMA_HEAP_SIZE=4
+LAMA_HEAP_SIZE=4 LAMA_GC_THREADS=4
+LAMA_HEAP_SIZE=4 LAMA_GC_INCREMENT=2
+LAMA_HEAP_SIZE=4 LAMA_GC=compact}"
 
 PASSED=0
 FAILED=0
@@ -13,6 +18,19 @@ FAILED=0
 declare -a FAILED_NAMES
 declare -a COMPILE_FAILED_NAMES
 
+# check NAME EXPECTED ACTUAL
+check() {
+	if ! [ "$2" = "$3" ]; then
+		echo -e "\033[91mtest failed!\033[m expected output:"
+		echo "$2"
+		FAILED=$(($FAILED + 1))
+		FAILED_NAMES+=("$1")
+	else
+		echo -e "\033[92mtest passed\033[m"
+		PASSED=$(($PASSED + 1))
+	fi
+}
+
 if [ -e "$LAMAC" ]
 then
     echo "lamac exists"
@@ -44,20 +62,51 @@ for FILE_PATH in "$TESTS_DIR"/*.lama; do
 	fi
 
 	INPUT_FILE="$TESTS_DIR/$STEM.input"
+	if ! [ -e "$INPUT_FILE" ]; then
+		INPUT_FILE=/dev/null
+	fi
+	EXPECTED_FILE="$TESTS_DIR/$STEM.expected"
 
-	# run the reference interpreter.
-	EXPECTED_OUTPUT="$("$LAMAC" -i "$FILE_PATH" < "$INPUT_FILE" 2>&1)"
+	# run the reference interpreter, unless the expected output is given.
+	if [ -e "$EXPECTED_FILE" ]; then
+		EXPECTED_OUTPUT="$(cat "$EXPECTED_FILE")"
+	else
+		EXPECTED_OUTPUT="$("$LAMAC" -i "$FILE_PATH" < "$INPUT_FILE" 2>&1)"
+	fi
 
-	ACTUAL_OUTPUT="$("$LAMA_INTERPRETER" "$BC_FILE" < "$INPUT_FILE" 2>&1 | tee /dev/tty)"
+	# environment of every run of the test, e.g. a heap limit.
+	TEST_ENV=""
+	if [ -e "$TESTS_DIR/$STEM.env" ]; then
+		TEST_ENV="$(cat "$TESTS_DIR/$STEM.env")"
+	fi
 
-	if ! [ "$EXPECTED_OUTPUT" = "$ACTUAL_OUTPUT" ]; then
-		echo -e "\033[91mtest failed!\033[m expected output:"
-		echo "$EXPECTED_OUTPUT"
-		FAILED=$(($FAILED + 1))
-		FAILED_NAMES+=("$FILE_NAME")
-	else
-		echo -e "\033[92mtest passed\033[m"
-		PASSED=$(($PASSED + 1))
+	ACTUAL_OUTPUT="$(env $TEST_ENV "$LAMA_INTERPRETER" "$BC_FILE" < "$INPUT_FILE" 2>&1 | tee /dev/tty)"
+	check "$FILE_NAME" "$EXPECTED_OUTPUT" "$ACTUAL_OUTPUT"
+
+	while read -r MODE; do
+		[ -n "$MODE" ] || continue
+		echo -e "\033[1mRunning $FILE_PATH with $MODE...\033[m" >&2
+		ACTUAL_OUTPUT="$(env $MODE $TEST_ENV "$LAMA_INTERPRETER" "$BC_FILE" < "$INPUT_FILE" 2>&1)"
+		check "$FILE_NAME ($MODE)" "$EXPECTED_OUTPUT" "$ACTUAL_OUTPUT"
+	done <<< "$GC_MODES"
+
+	# collections the test must go through: `environment: counter` lines,
+	# the counter being one of those LAMA_GC_STATS writes.
+	if [ -e "$TESTS_DIR/$STEM.gc" ]; then
+		while IFS=: read -r MODE COUNTER; do
+			[ -n "$COUNTER" ] || continue
+			COUNTER="${COUNTER// /}"
+			echo -e "\033[1mRunning $FILE_PATH with $MODE for $COUNTER...\033[m" >&2
+			STATS_FILE="$(mktemp)"
+			ACTUAL_OUTPUT="$(env $MODE $TEST_ENV LAMA_GC_STATS="$STATS_FILE" "$LAMA_INTERPRETER" "$BC_FILE" < "$INPUT_FILE" 2>&1)"
+			COUNT="$(awk -v name="$COUNTER" '$1 == name { print $2 }' "$STATS_FILE")"
+			rm -f "$STATS_FILE"
+			if [ "${COUNT:-0}" -eq 0 ]; then
+				ACTUAL_OUTPUT="$ACTUAL_OUTPUT
+no $COUNTER collection"
+			fi
+			check "$FILE_NAME ($MODE: $COUNTER)" "$EXPECTED_OUTPUT" "$ACTUAL_OUTPUT"
+		done < "$TESTS_DIR/$STEM.gc"
 	fi
 done
 
@@ -41,7 +41,28 @@ typedef enum {
     CALL_WRITE = 0x71,  // `CALL Lwrite`
     CALL_LENGTH = 0x72, // `CALL Llength`
     CALL_STRING = 0x73, // `CALL Lstring`
-    CALL_ARRAY = 0x74  // `CALL Barray`
+    CALL_ARRAY = 0x74,  // `CALL Barray`
+    // Internal instructions, produced by the bytecode optimizer
+    BEGIN_LEAF = 0x80,  // `BEGIN a 0` of a function without calls
+    END_LEAF = 0x81,    // `END` of a leaf function
+    CJMP_Z_INT = 0x82,  // `CJMPz l` on a proven integer
+    CJMP_NZ_INT = 0x83, // `CJMPnz l` on a proven integer
+    ELEM_AGG = 0x84,    // `ELEM` on a proven aggregate and integer index
+    STA_AGG = 0x85,     // `STA` on a proven aggregate and integer index
+    CALL_WRITE_INT = 0x86,  // `CALL Lwrite` on a proven integer
+    CALL_LENGTH_AGG = 0x87, // `CALL Llength` on a proven aggregate
+    ELEM_SAFE = 0x88,   // `ELEM` with an index proven to be in bounds
+    STA_SAFE = 0x89,    // `STA` with an index proven to be in bounds
+    MATCH = 0x8A,       // `DUP; [DUP;] test; CJMPnz l` heads of a pattern match, see match_table
+    STRING_SWITCH = 0x8B, // `DUP; STRING s; PATT =str; CJMPz l` arms of a match on strings, see string_switch
+    STRING_PATT = 0x8C, // `STRING s; PATT =str`
+    XSTRING_SHARED = 0x8D, // `STRING s` whose string is never written to nor leaves the frame
+    BARRAY_FRAME = 0x8E,  // `CALL Barray n` of an array that doesn't outlive the frame, built in its locals
+    BARRAY_RETURN = 0x8F, // `CALL Barray n` of a returned array, built in the region given by the caller if any
+    BINOP_INT = 0x90,   // `BINOP` on proven integers, same low bits as BINOP
+    CALL_FRAME = 0xA0,  // `CALL l n` giving the callee a region of the frame for its result
+    BEGIN_RETURN = 0xA1, // `BEGIN a n` of a function returning arrays in the region given by its caller
+    CALL_NATIVE = 0xA2  // `CALL l n` of a public function named after a runtime function, by its index in the native table
 } bytecode_type;
 
 // BINOP codes definitions
@@ -86,7 +107,8 @@ typedef enum {
     LD_HIGH_BITS = 0x02,
     LDA_HIGH_BITS = 0x03,
     ST_HIGH_BITS = 0x04,
-    PATT_HIGH_BITS = 0x06
+    PATT_HIGH_BITS = 0x06,
+    BINOP_INT_HIGH_BITS = 0x09
 } bytecode_high_bits;
 
 static inline u_int8_t high_bits(const u_int8_t instruction) {
@@ -110,6 +132,8 @@ static inline bytecode_type get_bytecode_type(const u_int8_t ip) {
             return ST;
         case PATT_HIGH_BITS:
             return PATT;
+        case BINOP_INT_HIGH_BITS:
+            return BINOP_INT;
         default:
             if (ip == BEGIN + 1) {
                 return BEGIN;
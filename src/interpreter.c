@@ -1,10 +1,22 @@
 #include "interpreter.h"
+#include "optimizer.h"
+#include "natives.h"
 
 static size_t RUNTIME_VSTACK_SIZE = 1024 * 1024;
 static u_int32_t *stack_fp;
 static u_int32_t *stack_start;
 static u_int32_t current_frame_locals;
 
+// Frame of the caller of the running leaf function (leaf functions never nest)
+static u_int32_t *leaf_caller_fp;
+static u_int32_t leaf_caller_locals;
+// Shared objects of string literals by string table offset, 0 if not created yet
+static u_int32_t *literal_cache;
+// Region of the caller's frame for the array returned by the function being called, NULL if none
+static u_int32_t *return_region;
+// Shared constructors without arguments by string table offset of their name, 0 if not created yet
+static u_int32_t *nullary_cache;
+
 void *__start_custom_data;
 void *__stop_custom_data;
 interpreter_state interpreterState;
@@ -139,6 +151,39 @@ static void jump(u_int32_t ip_offset) {
     interpreterState.ip = jmp_addr;
 }
 
+// Boolean as a tagged integer, without a branch
+static inline u_int32_t box_bool(int condition) {
+    return ((u_int32_t) condition << 1) | 1;
+}
+
+// Arithmetic on integer operands. Integers are tagged as 2x+1, so addition,
+// subtraction, multiplication and comparisons work on the tagged words directly;
+// unsigned arithmetic wraps exactly like BOX of the untagged result.
+static inline u_int32_t int_binop(u_int8_t op, u_int32_t a_val, u_int32_t b_val) {
+    switch (op) {
+        case PLUS:          return a_val + b_val - 1;
+        case MINUS:         return a_val - b_val + 1;
+        case MULTIPLY:      return (u_int32_t) UNBOX(a_val) * (b_val - 1) + 1;
+        case DIVIDE:
+            if (b_val == BOX(0)) runtime_error("Division by zero: a=%d, b=0", UNBOX(a_val));
+            return BOX(UNBOX(a_val) / UNBOX(b_val));
+        case REMAINDER:
+            if (b_val == BOX(0)) runtime_error("Remainder by zero: a=%d, b=0", UNBOX(a_val));
+            return BOX(UNBOX(a_val) % UNBOX(b_val));
+        case LESS:          return box_bool((int32_t) a_val < (int32_t) b_val);
+        case LESS_EQUAL:    return box_bool((int32_t) a_val <= (int32_t) b_val);
+        case GREATER:       return box_bool((int32_t) a_val > (int32_t) b_val);
+        case GREATER_EQUAL: return box_bool((int32_t) a_val >= (int32_t) b_val);
+        case EQUAL:         return box_bool(a_val == b_val);
+        case NOT_EQUAL:     return box_bool(a_val != b_val);
+        case AND:           return box_bool((a_val != BOX(0)) & (b_val != BOX(0)));
+        case OR:            return box_bool((a_val | b_val) != BOX(0));
+        default:
+            runtime_error("Unknown binop operator: %d", op);
+            return BOX(0);
+    }
+}
+
 void exec_binop(u_int8_t bytecode) {
     u_int32_t b_val = vstack_pop();
     u_int32_t a_val = vstack_pop();
@@ -151,9 +196,7 @@ void exec_binop(u_int8_t bytecode) {
     // For EQUAL, one of the operands must be an integer. Integers are never equal to values of other types.
     if (op == EQUAL) {
         if (a_is_int && b_is_int) {
-            int a = UNBOX(a_val);
-            int b = UNBOX(b_val);
-            vstack_push(BOX(a == b));
+            vstack_push(box_bool(a_val == b_val));
         } else if (a_is_int || b_is_int) {
             vstack_push(BOX(0));
         } else {
@@ -169,35 +212,14 @@ void exec_binop(u_int8_t bytecode) {
         runtime_error("BINOP expected integers, got %s and %s", type_name(a_val), type_name(b_val));
     }
 
-    int a = UNBOX(a_val);
-    int b = UNBOX(b_val);
-    int result;
-
-    switch (op) {
-        case PLUS:          result = a + b; break;
-        case MINUS:         result = a - b; break;
-        case MULTIPLY:      result = a * b; break;
-        case DIVIDE:
-            if (b == 0) runtime_error("Division by zero: a=%d, b=0", a);
-            result = a / b;
-            break;
-        case REMAINDER:
-            if (b == 0) runtime_error("Remainder by zero: a=%d, b=0", a);
-            result = a % b;
-            break;
-        case LESS:          result = a < b; break;
-        case LESS_EQUAL:    result = a <= b; break;
-        case GREATER:       result = a > b; break;
-        case GREATER_EQUAL: result = a >= b; break;
-        case EQUAL:         result = a == b; break;
-        case NOT_EQUAL:     result = a != b; break;
-        case AND:           result = a && b; break;
-        case OR:            result = a || b; break;
-        default:
-            runtime_error("Unknown binop bytecode: %d", low_bits(bytecode));
-    }
+    vstack_push(int_binop(op, a_val, b_val));
+}
 
-    vstack_push(BOX(result));
+// BINOP with operands proven to be integers by the optimizer
+void exec_binop_int(u_int8_t bytecode) {
+    u_int32_t b_val = vstack_pop();
+    u_int32_t a_val = vstack_pop();
+    vstack_push(int_binop(low_bits(bytecode), a_val, b_val));
 }
 
 void exec_ld(u_int8_t bytecode) {
@@ -215,47 +237,38 @@ void exec_lda(u_int8_t bytecode) {
 void exec_st(u_int8_t bytecode) {
     u_int32_t index = get_next_int();
     u_int32_t value = vstack_pop();
-    *get_by_loc(bytecode, index) = value;
+    u_int32_t *slot = get_by_loc(bytecode, index);
+    *slot = value;
+    // Captured variables live in the closure, on the heap
+    if (low_bits(bytecode) == L_CLOSURE) {
+        void *closure = (void *) *(stack_fp + *(stack_fp + 1) + 2);
+        gc_write_barrier(closure, slot, (void *) value);
+    }
     vstack_push(value);
 }
 
 void exec_patt(u_int8_t bytecode) {
-    u_int32_t *element = (u_int32_t *) vstack_pop();
-    u_int32_t result = -1;
+    u_int32_t element = vstack_pop();
+    if (low_bits(bytecode) == PATT_STR) {
+        vstack_push(Bstring_patt((u_int32_t *) element, (u_int32_t *) vstack_pop()));
+        return;
+    }
+
+    // Tag tests only need the header, which is read once
+    int tag = value_tag(element);
+    bool result = false;
     switch (low_bits(bytecode)) {
-        case PATT_STR: {
-            result = Bstring_patt(element, (u_int32_t *) vstack_pop());
-            break;
-        }
-        case PATT_TAG_STR: {
-            result = Bstring_tag_patt(element);
-            break;
-        }
-        case PATT_TAG_ARR: {
-            result = Barray_tag_patt(element);
-            break;
-        }
-        case PATT_TAG_SEXP: {
-            result = Bsexp_tag_patt(element);
-            break;
-        }
-        case PATT_BOXED: {
-            result = Bboxed_patt(element);
-            break;
-        }
-        case PATT_UNBOXED: {
-            result = Bunboxed_patt(element);
-            break;
-        }
-        case PATT_TAG_CLOSURE: {
-            result = Bclosure_tag_patt(element);
-            break;
-        }
+        case PATT_TAG_STR:     result = tag == STRING_TAG; break;
+        case PATT_TAG_ARR:     result = tag == ARRAY_TAG; break;
+        case PATT_TAG_SEXP:    result = tag == SEXP_TAG; break;
+        case PATT_BOXED:       result = !UNBOXED(element); break;
+        case PATT_UNBOXED:     result = UNBOXED(element); break;
+        case PATT_TAG_CLOSURE: result = tag == CLOSURE_TAG; break;
         default: {
             runtime_error("ERROR: Unknown pattern type.\n");
         }
     }
-    vstack_push(result);
+    vstack_push(BOX(result));
 }
 
 void exec_const() {
@@ -268,10 +281,71 @@ void exec_string() {
     vstack_push((u_int32_t) Bstring(string));
 }
 
+void exec_string_shared() {
+    u_int32_t offset = get_next_int();
+    // Checks the offset before it indexes the cache
+    char *literal = (char *) get_string_with_ip(interpreterState.byteFile, offset, interpreterState.ip);
+    u_int32_t string = literal_cache[offset];
+    if (string == 0) {
+        string = (u_int32_t) Bstring_literal(literal);
+        // The static space is full: fall back to a fresh copy each time
+        if (string == 0) string = (u_int32_t) Bstring(literal);
+        else literal_cache[offset] = string;
+    }
+    vstack_push(string);
+}
+
+static inline u_int32_t nullary_sexp(u_int32_t offset, u_int32_t sexp_tag) {
+    u_int32_t bsexp = nullary_cache[offset];
+    if (bsexp == 0) {
+        bsexp = (u_int32_t) Bsexp_nullary(sexp_tag);
+        // The static space is full: fall back to a fresh object each time
+        if (bsexp == 0) return (u_int32_t) Bsexp_my(BOX(1), sexp_tag, (int *) __gc_stack_top);
+        nullary_cache[offset] = bsexp;
+    }
+    return bsexp;
+}
+
+// Objects of up to this many words are allocated inline
+#define INLINE_ALLOC_WORDS 256
+
+// Bump allocation in the nursery; NULL when the runtime has to allocate,
+// possibly collecting garbage
+static inline u_int32_t *inline_alloc(u_int32_t words) {
+    u_int32_t *p = (u_int32_t *) nursery.current;
+    if (words > INLINE_ALLOC_WORDS || p + words > (u_int32_t *) nursery.end) {
+        return NULL;
+    }
+    nursery.current = (size_t *) (p + words);
+    return p;
+}
+
+// Fills the fields of a new object with the `n` values on top of the stack,
+// the last one being the topmost, and pops them
+static inline void pop_fields(u_int32_t *fields, u_int32_t n) {
+    for (u_int32_t i = 0; i < n; i++) {
+        fields[i] = __gc_stack_top[n - 1 - i];
+    }
+    __gc_stack_top += n;
+}
+
 void exec_sexp() {
-    char *sexp_name = get_next_string();
+    u_int32_t offset = get_next_int();
+    char *sexp_name = (char *) get_string_with_ip(interpreterState.byteFile, offset, interpreterState.ip);
     u_int32_t sexp_tag = LtagHash(sexp_name);
     u_int32_t sexp_arity = get_next_int();
+    if (sexp_arity == 0) {
+        vstack_push(nullary_sexp(offset, sexp_tag));
+        return;
+    }
+    u_int32_t *p = inline_alloc(sexp_arity + 2);
+    if (p != NULL) {
+        p[0] = UNBOX(sexp_tag);
+        p[1] = SEXP_TAG | (sexp_arity << 3);
+        pop_fields(p + 2, sexp_arity);
+        vstack_push((u_int32_t) (p + 2));
+        return;
+    }
     reverse_on_stack(sexp_arity);
     u_int32_t bsexp = (u_int32_t) Bsexp_my(BOX(sexp_arity + 1), sexp_tag, (int *) __gc_stack_top);
     __gc_stack_top += sexp_arity;
@@ -286,8 +360,14 @@ void exec_sta() {
     // its behavior depends on the second-to-top value on the stack, which must be either
     // a reference to a variable or an integer
     if (!UNBOXED(idx_val)) {
-        // Second-to-top value is a referene
-        vstack_push((u_int32_t) Bsta((void *) value, idx_val, 0));
+        // Second-to-top value is a referene: to a variable on the stack, or
+        // to one captured in the closure of the running function
+        u_int32_t *ref = (u_int32_t *) idx_val;
+        void *closure = NULL;
+        if (ref < stack_start || ref >= stack_start + RUNTIME_VSTACK_SIZE) {
+            closure = (void *) *(stack_fp + *(stack_fp + 1) + 2);
+        }
+        vstack_push((u_int32_t) Bsta((void *) value, idx_val, closure));
         return;
     }
 
@@ -319,6 +399,33 @@ void exec_sta() {
     vstack_push(result);
 }
 
+// Indexed STA on an aggregate and an integer index proven by the optimizer
+void exec_sta_agg() {
+    u_int32_t value = vstack_pop();
+    int32_t idx_val = vstack_pop(); //signed
+    u_int32_t obj = vstack_pop();
+
+    if (idx_val < 0) {
+        runtime_error("STA index cannot be negative: %d", idx_val);
+    }
+
+    int len = Llength((void*)obj);
+    if (idx_val >= len) {
+        runtime_error("STA index %d out of bounds (length %d)", idx_val, len);
+    }
+
+    u_int32_t result = (u_int32_t) Bsta((void*)value, idx_val, (void*)obj);
+    vstack_push(result);
+}
+
+// Indexed STA with an index proven to be in bounds by the optimizer
+void exec_sta_safe() {
+    u_int32_t value = vstack_pop();
+    int32_t idx_val = vstack_pop();
+    u_int32_t obj = vstack_pop();
+    vstack_push((u_int32_t) Bsta((void*)value, idx_val, (void*)obj));
+}
+
 void exec_jmp() {
     u_int32_t ip_offset = get_next_int();
     jump(ip_offset);
@@ -350,6 +457,21 @@ void exec_cjmp_nz() {
     }
 }
 
+// Conditional jumps on a value proven to be an integer
+void exec_cjmp_z_int() {
+    u_int32_t ip_offset = get_next_int();
+    if (vstack_pop() == BOX(0)) {
+        jump(ip_offset);
+    }
+}
+
+void exec_cjmp_nz_int() {
+    u_int32_t ip_offset = get_next_int();
+    if (vstack_pop() != BOX(0)) {
+        jump(ip_offset);
+    }
+}
+
 void exec_call_read() {
     int r = Lread();
     vstack_push(r);
@@ -365,6 +487,11 @@ void exec_call_write() {
     vstack_push(w);
 }
 
+void exec_call_write_int() {
+    int w = Lwrite((int) vstack_pop());
+    vstack_push(w);
+}
+
 void exec_call_string() {
     u_int32_t s = (u_int32_t) Lstring((void *) vstack_pop());
     vstack_push(s);
@@ -379,30 +506,81 @@ void exec_call_length() {
     vstack_push(l);
 }
 
-void exec_call_array() {
-    u_int32_t len = get_next_int();
+void exec_call_length_agg() {
+    u_int32_t l = (u_int32_t) Llength((void *) vstack_pop());
+    vstack_push(l);
+}
+
+static inline u_int32_t heap_array(u_int32_t len) {
+    u_int32_t *p = inline_alloc(len + 1);
+    if (p != NULL) {
+        p[0] = ARRAY_TAG | (len << 3);
+        pop_fields(p + 1, len);
+        return (u_int32_t) (p + 1);
+    }
     reverse_on_stack(len);
     u_int32_t result = (u_int32_t) Barray_my(BOX(len), (int *) __gc_stack_top);
     __gc_stack_top += len;
-    vstack_push(result);
+    return result;
+}
+
+// Builds an array of the `len` values on top of the stack in the region of the
+// VM stack starting at `region`. Its elements are found by the GC with the
+// rest of the stack, and the region itself is outside of the heap.
+static inline u_int32_t region_array(u_int32_t *region, u_int32_t len) {
+    region[0] = ARRAY_TAG | (len << 3);
+    for (u_int32_t i = 0; i < len; i++) {
+        region[1 + i] = __gc_stack_top[len - 1 - i];
+    }
+    __gc_stack_top += len;
+    return (u_int32_t) (region + 1);
+}
+
+// Region of the current frame addressed by its local with the lowest address
+static inline u_int32_t *frame_region(u_int32_t local) {
+    return stack_fp - local - 2;
+}
+
+void exec_call_array() {
+    u_int32_t len = get_next_int();
+    vstack_push(heap_array(len));
+}
+
+void exec_barray_frame() {
+    u_int32_t operand = get_next_int();
+    vstack_push(region_array(frame_region(operand >> 16), operand & 0xFFFF));
+}
+
+void exec_barray_return() {
+    u_int32_t operand = get_next_int();
+    u_int32_t *region = (u_int32_t *) *frame_region(operand >> 16);
+    u_int32_t len = operand & 0xFFFF;
+    vstack_push(region ? region_array(region, len) : heap_array(len));
 }
 
 void exec_closure() {
     u_int32_t ip = get_next_int();
     u_int32_t bn = get_next_int();
-    u_int32_t *values = (u_int32_t *) malloc(bn * sizeof(u_int32_t));
-    if (!values) {
-        runtime_error("CLOSURE: out of memory while allocating %u captured values", bn);
-    }
 
+    // The captured values stay on the stack, where the GC updates them, while the closure is allocated
     for (u_int32_t i = 0; i < bn; ++i) {
         u_int8_t b = (u_int8_t) get_next_byte();
         u_int32_t value = (u_int32_t) get_next_int();
-        values[i] = *get_by_loc(b, value);
+        vstack_push(*get_by_loc(b, value));
     }
 
-    u_int32_t bclosure = (u_int32_t) Bclosure_my(BOX(bn), interpreterState.byteFile->code_ptr + ip, (int*) values);
-    free(values);
+    u_int32_t *p = inline_alloc(bn + 2);
+    if (p != NULL) {
+        p[0] = CLOSURE_TAG | ((bn + 1) << 3);
+        p[1] = (u_int32_t) (interpreterState.byteFile->code_ptr + ip);
+        pop_fields(p + 2, bn);
+        vstack_push((u_int32_t) (p + 1));
+        return;
+    }
+    reverse_on_stack(bn);
+
+    u_int32_t bclosure = (u_int32_t) Bclosure_my(BOX(bn), interpreterState.byteFile->code_ptr + ip, (int*) __gc_stack_top);
+    __gc_stack_top += bn;
     vstack_push(bclosure);
 }
 
@@ -441,6 +619,31 @@ void exec_elem() {
     vstack_push(belem);
 }
 
+// ELEM on an aggregate and an integer index proven by the optimizer
+void exec_elem_agg() {
+    int32_t index = vstack_pop(); //signed
+    void *obj = (void *) vstack_pop();
+
+    if (index < 0) {
+        runtime_error("ELEM index cannot be negative: %d", index);
+    }
+
+    int len = Llength(obj);
+    if (index >= len) {
+        runtime_error("ELEM index %d out of bounds (length %d)", index, len);
+    }
+
+    u_int32_t belem = (u_int32_t) Belem(obj, index);
+    vstack_push(belem);
+}
+
+// ELEM with an index proven to be in bounds by the optimizer
+void exec_elem_safe() {
+    int32_t index = vstack_pop();
+    void *obj = (void *) vstack_pop();
+    vstack_push((u_int32_t) Belem(obj, index));
+}
+
 void exec_begin() {
     int32_t n_args = get_next_int();   // signed
     int32_t n_locals = get_next_int(); // signed
@@ -460,6 +663,13 @@ void exec_begin() {
     copy_on_stack(BOX(0), n_locals);
 }
 
+void exec_begin_return() {
+    u_int32_t *region = return_region;
+    return_region = NULL;
+    exec_begin();
+    *frame_region(current_frame_locals - 1) = (u_int32_t) region;
+}
+
 void exec_cbegin() {
     int32_t n_args = get_next_int(); // signed
     int32_t n_locals = get_next_int(); // signed
@@ -477,6 +687,25 @@ void exec_cbegin() {
     copy_on_stack(BOX(0), n_locals);
 }
 
+// BEGIN of a function without locals and calls. Only the slot of the saved fp
+// is reserved (it holds BOX(0), so it is never taken for a root); the caller
+// frame is kept aside until END_LEAF.
+void exec_begin_leaf() {
+    // Operands were validated by the optimizer
+    check_code_bounds(2 * sizeof(int));
+    interpreterState.ip += 2 * sizeof(int);
+
+    if (__gc_stack_top == stack_start) {
+        runtime_error("ERROR: Virtual stack limit exceeded.");
+    }
+    leaf_caller_fp = stack_fp;
+    leaf_caller_locals = current_frame_locals;
+
+    stack_fp = --__gc_stack_top;
+    *stack_fp = BOX(0);
+    current_frame_locals = 0;
+}
+
 void exec_end() {
     u_int32_t return_value = vstack_pop();
 
@@ -497,6 +726,21 @@ void exec_end() {
     interpreterState.ip = addr;
 }
 
+void exec_end_leaf() {
+    u_int32_t return_value = vstack_pop();
+
+    __gc_stack_top = stack_fp + 1;
+    u_int32_t n_args = *(__gc_stack_top++);
+    char *addr = (char *) *(__gc_stack_top++);
+    __gc_stack_top += n_args;
+
+    stack_fp = leaf_caller_fp;
+    current_frame_locals = leaf_caller_locals;
+
+    vstack_push(return_value);
+    interpreterState.ip = addr;
+}
+
 void exec_drop() {
     vstack_pop();
 }
@@ -508,15 +752,105 @@ void exec_dup() {
 void exec_tag() {
     char *tag_name = get_next_string();
     u_int32_t n = get_next_int();
-    u_int32_t t = LtagHash(tag_name);
-    void *d = (void *) vstack_pop();
-    vstack_push(Btag(d, t, BOX(n)));
+    u_int32_t d = vstack_pop();
+
+    // The name is hashed only for sexps of the right arity
+    bool result = false;
+    if (!UNBOXED(d)) {
+        int header = TO_DATA(d)->tag;
+        result = TAG(header) == SEXP_TAG && LEN(header) == n && TO_SEXP(d)->tag == UNBOX(LtagHash(tag_name));
+    }
+    vstack_push(BOX(result));
 }
 
 void exec_array() {
     u_int32_t len = get_next_int();
-    u_int32_t array = Barray_patt((u_int32_t *) vstack_pop(), BOX(len));
-    vstack_push(array);
+    u_int32_t d = vstack_pop();
+
+    bool result = false;
+    if (!UNBOXED(d)) {
+        int header = TO_DATA(d)->tag;
+        result = TAG(header) == ARRAY_TAG && LEN(header) == len;
+    }
+    vstack_push(BOX(result));
+}
+
+// Shape tests of a pattern match against the header read once
+static inline bool match_case_holds(const match_case *c, u_int32_t value, int tag, int length) {
+    switch (c->test) {
+        case MATCH_SEXP:
+            return tag == SEXP_TAG && length == c->length && TO_SEXP(value)->tag == c->tag;
+        case MATCH_ARRAY:        return tag == ARRAY_TAG && length == c->length;
+        case MATCH_STRING_TAG:   return tag == STRING_TAG;
+        case MATCH_ARRAY_TAG:    return tag == ARRAY_TAG;
+        case MATCH_SEXP_TAG:     return tag == SEXP_TAG;
+        case MATCH_CLOSURE_TAG:  return tag == CLOSURE_TAG;
+        case MATCH_BOXED:        return !UNBOXED(value);
+        case MATCH_UNBOXED:      return UNBOXED(value);
+        default:                 return false;
+    }
+}
+
+void exec_match() {
+    u_int32_t index = get_next_int();
+    const match_table *table = &match_tables[index];
+    u_int32_t value = vstack_pop();
+
+    // Integers have no header: only MATCH_UNBOXED may hold
+    int tag = 0;
+    int length = -1;
+    if (!UNBOXED(value)) {
+        data *d = TO_DATA(value);
+        tag = TAG(d->tag);
+        length = LEN(d->tag);
+    }
+
+    for (u_int32_t i = 0; i < table->cases_number; i++) {
+        const match_case *c = &table->cases[i];
+        if (match_case_holds(c, value, tag, length)) {
+            vstack_push(value);
+            if (table->keep_value) vstack_push(value);
+            jump(c->target);
+            return;
+        }
+    }
+
+    if (table->keep_value) vstack_push(value);
+    jump(table->otherwise);
+}
+
+// Arm of a string literal equal to the value, NULL if there is none. Compares
+// like strcmp: up to the terminator.
+static inline const string_case *find_string_case(const string_switch *sw, u_int32_t value) {
+    if (UNBOXED(value)) return NULL;
+    data *d = TO_DATA(value);
+    if (TAG(d->tag) != STRING_TAG) return NULL;
+
+    u_int32_t length;
+    u_int32_t hash = string_hash(d->contents, LEN(d->tag), &length);
+    for (u_int32_t i = hash & sw->mask;; i = (i + 1) & sw->mask) {
+        const string_case *c = &sw->buckets[i];
+        if (c->chars == NULL) return NULL;
+        if (c->hash == hash && c->length == length && memcmp(c->chars, d->contents, length) == 0) return c;
+    }
+}
+
+void exec_string_switch() {
+    u_int32_t index = get_next_int();
+    const string_switch *sw = &string_switches[index];
+    u_int32_t value = vstack_pop();
+    vstack_push(value);
+
+    const string_case *c = find_string_case(sw, value);
+    jump(c ? c->target : sw->otherwise);
+}
+
+void exec_string_patt() {
+    u_int32_t index = get_next_int();
+    u_int32_t value = vstack_pop();
+    vstack_push(BOX(find_string_case(&string_switches[index], value) != NULL));
+    // Skip the covered length
+    interpreterState.ip += 1;
 }
 
 void exec_fail() {
@@ -542,6 +876,25 @@ void exec_call() {
     interpreterState.ip = interpreterState.byteFile->code_ptr + call_offset;
 }
 
+void exec_call_frame() {
+    u_int32_t call_offset = get_next_int();
+    u_int32_t operand = get_next_int();
+    u_int32_t n_args = operand & 0xFFFF;
+    return_region = frame_region(operand >> 16);
+    reverse_on_stack(n_args);
+    vstack_push((u_int32_t) interpreterState.ip);
+    vstack_push(n_args);
+    interpreterState.ip = interpreterState.byteFile->code_ptr + call_offset;
+}
+
+void exec_call_native() {
+    u_int32_t index = get_next_int();
+    u_int32_t n_args = get_next_int();
+    u_int32_t result = call_native(index, n_args, __gc_stack_top);
+    __gc_stack_top += n_args;
+    vstack_push(result);
+}
+
 void exec_callc() {
     u_int32_t n_args = get_next_int();
 
@@ -599,12 +952,37 @@ static inline char* find_main_entrypoint(byte_file *bf, const char *code_end) {
     return NULL; // unreachable
 }
 
+// Precise GC roots of the VM stack: the operands, locals and arguments of
+// every frame, and the globals. The saved fp and locals count, the number of
+// arguments and the return address of a frame are skipped.
+static void scan_stack_roots(void) {
+    u_int32_t *top = __gc_stack_top;
+    u_int32_t *fp = stack_fp;
+
+    while (fp != interpreterState.globals_base) {
+        // The frame of a leaf function only has the slot of its saved fp, holding BOX(0)
+        bool leaf = *fp == BOX(0);
+        for (u_int32_t *p = top; p < (leaf ? fp : fp - 1); p++) {
+            gc_test_and_copy_root((size_t **) p);
+        }
+        // The arguments belong to the operands of the caller
+        top = fp + 3;
+        fp = leaf ? leaf_caller_fp : (u_int32_t *) *fp;
+    }
+    for (u_int32_t *p = top; p < __gc_stack_bottom; p++) {
+        gc_test_and_copy_root((size_t **) p);
+    }
+}
+
 void init_interpreter(byte_file *bf) {
-    stack_start = malloc(RUNTIME_VSTACK_SIZE * sizeof(u_int32_t));
+    stack_start = calloc(RUNTIME_VSTACK_SIZE, sizeof(u_int32_t));
     if (stack_start == NULL) {
         runtime_error("ERROR: Failed to allocate memory for virtual stack.");
     }
     // init __gc_stack_bottom and __gc_stack_top for detection of lama GC and call extern __gc__init
+    // __gc_init sets the stack bottom to the one of the C stack, so it goes first
+    __gc_init();
+    gc_set_stack_root_scanner(scan_stack_roots);
     __gc_stack_bottom = stack_start + RUNTIME_VSTACK_SIZE;
     __gc_stack_top = __gc_stack_bottom;
 
@@ -612,8 +990,6 @@ void init_interpreter(byte_file *bf) {
     __gc_stack_top -= bf->global_area_size;
     interpreterState.globals_base = __gc_stack_top;
 
-    __gc_init();
-
     stack_fp = __gc_stack_top;
     vstack_push(0); // argv
     vstack_push(0); // argc
@@ -622,6 +998,12 @@ void init_interpreter(byte_file *bf) {
     interpreterState.byteFile = bf;
     interpreterState.code_start = bf->code_ptr;
     interpreterState.code_end = bf->code_ptr + bf->code_size;
+    literal_cache = calloc(bf->string_table_size, sizeof(u_int32_t));
+    nullary_cache = calloc(bf->string_table_size, sizeof(u_int32_t));
+    if (literal_cache == NULL || nullary_cache == NULL) {
+        runtime_error("ERROR: Failed to allocate memory for string literals.");
+    }
+    optimize_bytecode(bf);
     interpreterState.ip = find_main_entrypoint(bf, (const char*) interpreterState.code_end);
     // DEBUG
 //    printf("\nCode_start=%p\nCode_end=%p\nCode_size=%u\nip=%p\n",
@@ -669,6 +1051,8 @@ void interpret() {
             EXEC(CALL_LENGTH, call_length)
             EXEC(CALL_ARRAY, call_array)
             EXEC(END, end)
+            EXEC(BEGIN_LEAF, begin_leaf)
+            EXEC(END_LEAF, end_leaf)
             EXEC(DROP, drop)
             EXEC(DUP, dup)
             EXEC(TAG, tag)
@@ -677,6 +1061,24 @@ void interpret() {
             EXEC(LINE, line)
             EXEC(CLOSURE, closure)
             EXEC(SWAP, swap)
+            EXEC_WITH_LOWER_BITS(BINOP_INT, binop_int)
+            EXEC(CJMP_Z_INT, cjmp_z_int)
+            EXEC(CJMP_NZ_INT, cjmp_nz_int)
+            EXEC(ELEM_AGG, elem_agg)
+            EXEC(STA_AGG, sta_agg)
+            EXEC(ELEM_SAFE, elem_safe)
+            EXEC(STA_SAFE, sta_safe)
+            EXEC(MATCH, match)
+            EXEC(STRING_SWITCH, string_switch)
+            EXEC(STRING_PATT, string_patt)
+            EXEC(XSTRING_SHARED, string_shared)
+            EXEC(BARRAY_FRAME, barray_frame)
+            EXEC(BARRAY_RETURN, barray_return)
+            EXEC(CALL_FRAME, call_frame)
+            EXEC(BEGIN_RETURN, begin_return)
+            EXEC(CALL_NATIVE, call_native)
+            EXEC(CALL_WRITE_INT, call_write_int)
+            EXEC(CALL_LENGTH_AGG, call_length_agg)
             case STI:
                 runtime_error("ERROR: STI bytecode is deprecated.\n");
                 break;
@@ -690,3 +1092,26 @@ void interpret() {
 #undef EXEC_WITH_LOWER_BITS
 #undef EXEC
 }
+
+u_int32_t call_closure(u_int32_t closure, u_int32_t n_args, const u_int32_t *args) {
+    if (!is_closure(closure)) {
+        runtime_error("call_closure: expected a closure, got %s", type_name(closure));
+    }
+
+    // Lay out the call as CALLC does, returning to a null address so that the
+    // nested loop stops at the callee's END
+    char *saved_ip = interpreterState.ip;
+    vstack_push(closure);
+    for (u_int32_t i = 0; i < n_args; i++) {
+        vstack_push(args[i]);
+    }
+    reverse_on_stack(n_args);
+    vstack_push(0);
+    vstack_push(n_args + 1);
+    interpreterState.ip = (char *) Belem((u_int32_t *) closure, BOX(0));
+
+    interpret();
+
+    interpreterState.ip = saved_ip;
+    return vstack_pop();
+}
@@ -9,22 +9,17 @@ extern int Lwrite(int);
 extern int Llength(void *);
 extern void *Lstring(void *p);
 extern void *Bstring(void *);
+extern void *Bstring_literal(char *p);
 extern void *Belem(void *p, int i);
 extern void *Bsta(void *v, int i, void *x);
 extern void *Barray_my(int bn, int *data_);
 extern void *Bsexp_my(int bn, int tag, int *data_);
+extern void *Bsexp_nullary(int tag);
 extern int LtagHash(char *s);
 extern int Btag(void *d, int t, int n);
-extern int Barray_patt(void *d, int n);
 extern void *Bclosure_my(int bn, void *entry, int *values);
 extern void *Belem_link(void *p, int i);
 extern int Bstring_patt(void *x, void *y);
-extern int Bstring_tag_patt(void *x);
-extern int Barray_tag_patt(void *x);
-extern int Bsexp_tag_patt(void *x);
-extern int Bunboxed_patt(void *x);
-extern int Bboxed_patt(void *x);
-extern int Bclosure_tag_patt(void *x);
 
 // Data struct from runtime.c
 typedef struct {
@@ -43,13 +38,23 @@ typedef struct {
 # define SEXP_TAG    0x00000005
 # define CLOSURE_TAG 0x00000007
 # define TAG(x)  (x & 0x00000007)
+# define LEN(x)  ((x & 0xFFFFFFF8) >> 3)
+
+typedef struct {
+  int tag;
+  data contents;
+} sexp;
+
+# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(int)))
+
+// Header tag of a boxed value, 0 for integers
+static inline int value_tag(u_int32_t val) {
+    return UNBOXED(val) ? 0 : TAG(TO_DATA((void *) val)->tag);
+}
 
 // Check, if given value matches wanted tag
 static inline bool check_tag(u_int32_t val, u_int32_t wanted_tag) {
-    if (UNBOXED(val)) return false;
-
-    data *d = TO_DATA((void *)val);
-    return TAG(d->tag) == wanted_tag;
+    return value_tag(val) == (int) wanted_tag;
 }
 
 static inline bool is_string(u_int32_t val) {
@@ -102,3 +107,8 @@ extern interpreter_state interpreterState;
 
 void init_interpreter(byte_file *bf);
 void interpret();
+
+// Calls `closure` with `n_args` arguments from native code and runs it to its
+// return. The arguments are on the VM stack during the call, so a collection
+// triggered by the callee leaves the caller's copies in `args` stale.
+u_int32_t call_closure(u_int32_t closure, u_int32_t n_args, const u_int32_t *args);
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "natives.h"
+#include "interpreter.h"
+
+// Runtime library, see runtime/Std.i
+extern void  Lassert(void *f, char *s, ...);
+extern void *LgetEnv(char *var);
+extern int   Lsystem(char *cmd);
+extern void *LstringInt(char *b);
+extern void *LmakeArray(int length);
+extern void *Lclone(void *p);
+extern int   Lhash(void *p);
+extern void *Lfst(void *v);
+extern void *Lsnd(void *v);
+extern void *Lhd(void *v);
+extern void *Ltl(void *v);
+extern void *LreadLine();
+extern void *Lstringcat(void *p);
+extern int   LmatchSubString(char *subj, char *patt, int pos);
+extern void *Lsubstring(void *subj, int p, int l);
+extern void *Lregexp(char *regexp);
+extern void *LregexpMatch(void *b, char *s, int pos);
+extern void *Lsprintf(char *fmt, ...);
+extern void *LmakeString(int length);
+extern void  Lprintf(char *s, ...);
+extern void  Lfprintf(FILE *f, char *s, ...);
+extern FILE *Lfopen(char *f, char *m);
+extern void  Lfclose(FILE *f);
+extern void *Lfread(char *fname);
+extern void  Lfwrite(char *fname, char *contents);
+extern void *Lfexists(char *fname);
+extern void  Lfailure(char *s, ...);
+extern int   Lcompare(void *p, void *q);
+extern void *Ls__Infix_58(void *p, void *q);
+extern int   Ls__Infix_3333(void *p, void *q);
+extern int   Ls__Infix_3838(void *p, void *q);
+extern int   Ls__Infix_6161(void *p, void *q);
+extern int   Ls__Infix_3361(void *p, void *q);
+extern int   Ls__Infix_6061(void *p, void *q);
+extern int   Ls__Infix_60(void *p, void *q);
+extern int   Ls__Infix_6261(void *p, void *q);
+extern int   Ls__Infix_62(void *p, void *q);
+extern int   Ls__Infix_43(void *p, void *q);
+extern int   Ls__Infix_45(void *p, void *q);
+extern int   Ls__Infix_42(void *p, void *q);
+extern int   Ls__Infix_47(void *p, void *q);
+extern int   Ls__Infix_37(void *p, void *q);
+extern void  LenableGC();
+extern void  LdisableGC();
+extern int   Lrandom(int n);
+extern int   Ltime();
+extern int   LkindOf(void *p);
+extern int   LcompareTags(void *p, void *q);
+extern int   LflatCompare(void *p, void *q);
+extern int   LtagHash(char *s);
+extern int   Luppercase(void *v);
+extern int   Llowercase(void *v);
+extern void *LhashMap();
+extern int   LhashMapSize(void *m);
+extern void *LhashMapFind(void *m, void *key, void *def);
+extern void *LhashMapInsert(void *m, void *key, void *value);
+extern void *LhashMapRemove(void *m, void *key);
+extern void *LhashMapEntries(void *m);
+extern int   LlistLength(void *l);
+extern void *LlistNth(void *l, int i);
+extern void *LlistReverse(void *l);
+extern void *LlistAppend(void *a, void *b);
+extern void *LlistArray(void *l);
+extern void *LarrayList(void *a);
+extern void *LmakeArrayOf(int length, void *v);
+extern void *LarrayFill(void *a, void *v);
+extern void *LarrayBlit(void *src, int src_pos, void *dst, int dst_pos, int len);
+extern int   LarraySum(void *a);
+extern int   LarrayMin(void *a);
+extern int   LarrayMax(void *a);
+extern void *Bsexp(int n, ...);
+extern void  push_extra_root(void **p);
+extern void  pop_extra_root(void **p);
+
+// Sorting of arrays and lists, in the Lcompare order or by a comparison
+// closure returning a negative, zero or positive integer. A closure may
+// allocate, so everything held across its calls is an extra root and array
+// elements are re-read after each comparison.
+typedef struct {
+    u_int32_t *values;  // array being sorted
+    u_int32_t *scratch; // merge buffer of the same length, NULL for short arrays
+    u_int32_t  closure; // 0 for the Lcompare order
+    u_int32_t  held;    // element taken out of `values` by the insertion sort
+} sort_state;
+
+// Length of the runs sorted by insertion before merging
+#define SORT_RUN 8
+
+static int32_t sort_compare(sort_state *s, u_int32_t a, u_int32_t b) {
+    if (s->closure == 0) return UNBOX(Lcompare((void *) a, (void *) b));
+
+    u_int32_t args[2] = {a, b};
+    u_int32_t result = call_closure(s->closure, 2, args);
+    if (!UNBOXED(result)) {
+        failure("sort: the comparison returned %s instead of an integer\n", type_name(result));
+    }
+    return UNBOX(result);
+}
+
+static void sort_insertion(sort_state *s, u_int32_t lo, u_int32_t hi) {
+    for (u_int32_t i = lo + 1; i < hi; i++) {
+        s->held = s->values[i];
+        u_int32_t j = i;
+        while (j > lo && sort_compare(s, s->held, s->values[j - 1]) < 0) {
+            s->values[j] = s->values[j - 1];
+            j--;
+        }
+        s->values[j] = s->held;
+    }
+}
+
+// Merges the sorted runs [lo, mid) and [mid, hi) of *src into *dst, taking
+// from the left run on ties
+static void sort_merge(sort_state *s, u_int32_t **src, u_int32_t **dst,
+                       u_int32_t lo, u_int32_t mid, u_int32_t hi) {
+    u_int32_t i = lo, j = mid, k = lo;
+    while (i < mid && j < hi) {
+        if (sort_compare(s, (*src)[j], (*src)[i]) < 0) {
+            (*dst)[k++] = (*src)[j++];
+        } else {
+            (*dst)[k++] = (*src)[i++];
+        }
+    }
+    while (i < mid) (*dst)[k++] = (*src)[i++];
+    while (j < hi) (*dst)[k++] = (*src)[j++];
+}
+
+// Stable bottom-up merge sort of s->values in place
+static void sort_values(sort_state *s, u_int32_t n) {
+    push_extra_root((void **) &s->values);
+    push_extra_root((void **) &s->scratch);
+    push_extra_root((void **) &s->closure);
+    push_extra_root((void **) &s->held);
+
+    if (n > SORT_RUN) {
+        s->scratch = LmakeArray(BOX(n));
+    }
+    // Elements are only ever moved between the arrays and `held`, so once a
+    // minor collection has promoted them no young value can be stored back
+    gc_remember_object(s->values);
+    gc_remember_object(s->scratch);
+    for (u_int32_t lo = 0; lo < n; lo += SORT_RUN) {
+        sort_insertion(s, lo, lo + SORT_RUN < n ? lo + SORT_RUN : n);
+    }
+
+    u_int32_t **src = &s->values, **dst = &s->scratch;
+    for (u_int32_t width = SORT_RUN; width < n; width *= 2) {
+        for (u_int32_t lo = 0; lo < n; lo += 2 * width) {
+            u_int32_t mid = lo + width < n ? lo + width : n;
+            u_int32_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            sort_merge(s, src, dst, lo, mid, hi);
+        }
+        u_int32_t **t = src; src = dst; dst = t;
+    }
+    if (src != &s->values) {
+        memcpy(s->values, s->scratch, n * sizeof(u_int32_t));
+    }
+
+    pop_extra_root((void **) &s->held);
+    pop_extra_root((void **) &s->closure);
+    pop_extra_root((void **) &s->scratch);
+    pop_extra_root((void **) &s->values);
+}
+
+static void *sort_array(const char *what, void *a, u_int32_t closure) {
+    if (!is_array((u_int32_t) a)) failure("%s: array expected, got %s\n", what, type_name((u_int32_t) a));
+    sort_state s = {a, NULL, closure, BOX(0)};
+    sort_values(&s, LEN(TO_DATA(a)->tag));
+    return s.values;
+}
+
+// Copies the list into a scratch array, sorts it and conses the result up
+// from its end
+static void *sort_list(const char *what, void *list, u_int32_t closure) {
+    u_int32_t n = 0;
+    for (u_int32_t l = (u_int32_t) list; !UNBOXED(l); l = ((u_int32_t *) l)[1]) {
+        if (!is_sexp(l) || LEN(TO_DATA((void *) l)->tag) != 2) {
+            failure("%s: list expected, got %s\n", what, type_name(l));
+        }
+        n++;
+    }
+    if (n < 2) return list;
+
+    push_extra_root(&list);
+    u_int32_t *values = LmakeArray(BOX(n));
+    pop_extra_root(&list);
+    u_int32_t *cell = list;
+    for (u_int32_t i = 0; i < n; i++, cell = (u_int32_t *) cell[1]) {
+        values[i] = cell[0];
+    }
+
+    sort_state s = {values, NULL, closure, BOX(0)};
+    sort_values(&s, n);
+
+    void *result = (void *) BOX(0);
+    push_extra_root((void **) &s.values);
+    push_extra_root(&result);
+    u_int32_t cons = LtagHash("cons");
+    for (u_int32_t i = n; i-- > 0;) {
+        cell = Bsexp(BOX(3), BOX(0), BOX(0), cons);
+        cell[0] = s.values[i];
+        cell[1] = (u_int32_t) result;
+        result = cell;
+    }
+    pop_extra_root(&result);
+    pop_extra_root((void **) &s.values);
+    return result;
+}
+
+void *LsortArray(void *a) {
+    return sort_array("sortArray", a, 0);
+}
+
+void *LsortArrayBy(void *a, void *f) {
+    return sort_array("sortArrayBy", a, (u_int32_t) f);
+}
+
+void *LsortList(void *l) {
+    return sort_list("sortList", l, 0);
+}
+
+void *LsortListBy(void *l, void *f) {
+    return sort_list("sortListBy", l, (u_int32_t) f);
+}
+
+// Array traversals calling a closure back for each element; the arrays and
+// the accumulator are extra roots across the calls
+void *LarrayMap(void *f, void *a) {
+    if (!is_array((u_int32_t) a)) failure("arrayMap: array expected, got %s\n", type_name((u_int32_t) a));
+    u_int32_t n = LEN(TO_DATA(a)->tag);
+
+    push_extra_root(&f);
+    push_extra_root(&a);
+    u_int32_t *result = LmakeArray(BOX(n));
+    push_extra_root((void **) &result);
+    for (u_int32_t i = 0; i < n; i++) {
+        u_int32_t value = call_closure((u_int32_t) f, 1, (u_int32_t *) a + i);
+        result[i] = value;
+        gc_write_barrier(result, result + i, (void *) value);
+    }
+    pop_extra_root((void **) &result);
+    pop_extra_root(&a);
+    pop_extra_root(&f);
+    return result;
+}
+
+void *LarrayFold(void *f, void *acc, void *a) {
+    if (!is_array((u_int32_t) a)) failure("arrayFold: array expected, got %s\n", type_name((u_int32_t) a));
+    u_int32_t n = LEN(TO_DATA(a)->tag);
+
+    push_extra_root(&f);
+    push_extra_root(&acc);
+    push_extra_root(&a);
+    for (u_int32_t i = 0; i < n; i++) {
+        u_int32_t args[2] = {(u_int32_t) acc, ((u_int32_t *) a)[i]};
+        acc = (void *) call_closure((u_int32_t) f, 2, args);
+    }
+    pop_extra_root(&a);
+    pop_extra_root(&acc);
+    pop_extra_root(&f);
+    return acc;
+}
+
+// Most arguments a variadic native function can be called with
+#define MAX_NATIVE_ARGS 8
+
+#define NATIVE(name, arity) {#name, (arity), true, false, (void *) name}
+#define NATIVE_VOID(name, arity) {#name, (arity), false, false, (void *) name}
+#define INTRINSIC(name, arity) {#name, (arity), true, true, (void *) name}
+#define VARIADIC(min_arity) (-1 - (min_arity))
+
+static const native_function natives[] = {
+    NATIVE_VOID(Lassert, VARIADIC(2)),
+    NATIVE(LgetEnv, 1),
+    NATIVE(Lsystem, 1),
+    NATIVE(LstringInt, 1),
+    NATIVE(LmakeArray, 1),
+    NATIVE(Lstring, 1),
+    NATIVE(Llength, 1),
+    NATIVE(Lclone, 1),
+    NATIVE(Lhash, 1),
+    NATIVE(Lfst, 1),
+    NATIVE(Lsnd, 1),
+    NATIVE(Lhd, 1),
+    NATIVE(Ltl, 1),
+    NATIVE(LreadLine, 0),
+    NATIVE(Lstringcat, 1),
+    NATIVE(LmatchSubString, 3),
+    NATIVE(Lsubstring, 3),
+    NATIVE(Lregexp, 1),
+    NATIVE(LregexpMatch, 3),
+    NATIVE(Lsprintf, VARIADIC(1)),
+    NATIVE(LmakeString, 1),
+    NATIVE_VOID(Lprintf, VARIADIC(1)),
+    NATIVE_VOID(Lfprintf, VARIADIC(2)),
+    NATIVE(Lfopen, 2),
+    NATIVE_VOID(Lfclose, 1),
+    NATIVE(Lfread, 1),
+    NATIVE_VOID(Lfwrite, 2),
+    NATIVE(Lfexists, 1),
+    NATIVE_VOID(Lfailure, VARIADIC(1)),
+    NATIVE(Lread, 0),
+    NATIVE(Lwrite, 1),
+    NATIVE(Lcompare, 2),
+    NATIVE(Ls__Infix_58, 2),
+    NATIVE(Ls__Infix_3333, 2),
+    NATIVE(Ls__Infix_3838, 2),
+    NATIVE(Ls__Infix_6161, 2),
+    NATIVE(Ls__Infix_3361, 2),
+    NATIVE(Ls__Infix_6061, 2),
+    NATIVE(Ls__Infix_60, 2),
+    NATIVE(Ls__Infix_6261, 2),
+    NATIVE(Ls__Infix_62, 2),
+    NATIVE(Ls__Infix_43, 2),
+    NATIVE(Ls__Infix_45, 2),
+    NATIVE(Ls__Infix_42, 2),
+    NATIVE(Ls__Infix_47, 2),
+    NATIVE(Ls__Infix_37, 2),
+    NATIVE_VOID(LenableGC, 0),
+    NATIVE_VOID(LdisableGC, 0),
+    NATIVE(Lrandom, 1),
+    NATIVE(Ltime, 0),
+    NATIVE(LkindOf, 1),
+    NATIVE(LcompareTags, 2),
+    NATIVE(LflatCompare, 2),
+    NATIVE(LtagHash, 1),
+    NATIVE(Luppercase, 1),
+    NATIVE(Llowercase, 1),
+    INTRINSIC(LhashMap, 0),
+    INTRINSIC(LhashMapSize, 1),
+    INTRINSIC(LhashMapFind, 3),
+    INTRINSIC(LhashMapInsert, 3),
+    INTRINSIC(LhashMapRemove, 2),
+    INTRINSIC(LhashMapEntries, 1),
+    INTRINSIC(LlistLength, 1),
+    INTRINSIC(LlistNth, 2),
+    INTRINSIC(LlistReverse, 1),
+    INTRINSIC(LlistAppend, 2),
+    INTRINSIC(LlistArray, 1),
+    INTRINSIC(LarrayList, 1),
+    INTRINSIC(LmakeArrayOf, 2),
+    INTRINSIC(LarrayFill, 2),
+    INTRINSIC(LarrayBlit, 5),
+    INTRINSIC(LarraySum, 1),
+    INTRINSIC(LarrayMin, 1),
+    INTRINSIC(LarrayMax, 1),
+    INTRINSIC(LarrayMap, 2),
+    INTRINSIC(LarrayFold, 3),
+    INTRINSIC(LsortArray, 1),
+    INTRINSIC(LsortArrayBy, 2),
+    INTRINSIC(LsortList, 1),
+    INTRINSIC(LsortListBy, 2),
+};
+
+#undef NATIVE
+#undef NATIVE_VOID
+#undef INTRINSIC
+
+#define NATIVES_NUMBER (sizeof(natives) / sizeof(natives[0]))
+
+int32_t find_native(const char *name, int32_t n_args) {
+    for (u_int32_t i = 0; i < NATIVES_NUMBER; i++) {
+        if (strcmp(natives[i].name, name) != 0) continue;
+        int32_t arity = natives[i].arity;
+        if (arity >= 0 ? n_args == arity : n_args >= VARIADIC(arity) && n_args <= MAX_NATIVE_ARGS) {
+            return i;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+int32_t find_intrinsic(const char *name, int32_t n_args) {
+    int32_t index = find_native(name, n_args);
+    return index >= 0 && natives[index].intrinsic ? index : -1;
+}
+
+#undef VARIADIC
+
+typedef u_int32_t (*native_0)(void);
+typedef u_int32_t (*native_1)(u_int32_t);
+typedef u_int32_t (*native_2)(u_int32_t, u_int32_t);
+typedef u_int32_t (*native_3)(u_int32_t, u_int32_t, u_int32_t);
+typedef u_int32_t (*native_4)(u_int32_t, u_int32_t, u_int32_t, u_int32_t);
+typedef u_int32_t (*native_5)(u_int32_t, u_int32_t, u_int32_t, u_int32_t, u_int32_t);
+typedef u_int32_t (*native_variadic)(u_int32_t, ...);
+
+// The arguments are read in place, so they stay GC roots for the duration of the call
+u_int32_t call_native(u_int32_t index, u_int32_t n_args, const u_int32_t *top) {
+    const native_function *f = &natives[index];
+    const u_int32_t *a = top + n_args - 1; // the first argument, the others are below it
+    u_int32_t result;
+
+    if (f->arity < 0) {
+        native_variadic entry = (native_variadic) f->entry;
+        switch (n_args) {
+            case 1: result = entry(a[0]); break;
+            case 2: result = entry(a[0], a[-1]); break;
+            case 3: result = entry(a[0], a[-1], a[-2]); break;
+            case 4: result = entry(a[0], a[-1], a[-2], a[-3]); break;
+            case 5: result = entry(a[0], a[-1], a[-2], a[-3], a[-4]); break;
+            case 6: result = entry(a[0], a[-1], a[-2], a[-3], a[-4], a[-5]); break;
+            case 7: result = entry(a[0], a[-1], a[-2], a[-3], a[-4], a[-5], a[-6]); break;
+            default: result = entry(a[0], a[-1], a[-2], a[-3], a[-4], a[-5], a[-6], a[-7]); break;
+        }
+    } else {
+        switch (n_args) {
+            case 0: result = ((native_0) f->entry)(); break;
+            case 1: result = ((native_1) f->entry)(a[0]); break;
+            case 2: result = ((native_2) f->entry)(a[0], a[-1]); break;
+            case 3: result = ((native_3) f->entry)(a[0], a[-1], a[-2]); break;
+            case 4: result = ((native_4) f->entry)(a[0], a[-1], a[-2], a[-3]); break;
+            default: result = ((native_5) f->entry)(a[0], a[-1], a[-2], a[-3], a[-4]); break;
+        }
+    }
+    return f->returns ? result : BOX(0);
+}
@@ -0,0 +1,27 @@
+#ifndef NATIVES_H
+#define NATIVES_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Functions of the runtime library (see runtime/Std.i) callable from bytecode
+typedef struct {
+    const char *name;    // symbol name, e.g. `Lsubstring`
+    int32_t     arity;   // number of arguments, -1 - the minimum one for variadic functions
+    bool        returns; // false for functions without a result, which then return BOX(0)
+    bool        intrinsic; // true for functions a public Lama function of the same name stands for
+    void       *entry;
+} native_function;
+
+// Index of the native function `name` callable with `n_args` arguments, -1 if none
+int32_t find_native(const char *name, int32_t n_args);
+
+// Index of the intrinsic `name` callable with `n_args` arguments, -1 if none:
+// Std and Lama built-ins such as `Llength` are never intrinsics
+int32_t find_intrinsic(const char *name, int32_t n_args);
+
+// Calls the native function `index` with the `n_args` values on top of the
+// stack at `top`, the last argument being the topmost
+u_int32_t call_native(u_int32_t index, u_int32_t n_args, const u_int32_t *top);
+
+#endif
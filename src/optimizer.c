@@ -0,0 +1,1610 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "byte_file.h"
+#include "bytecode_decoder.h"
+#include "optimizer.h"
+#include "natives.h"
+
+extern int LtagHash(char *);
+
+// End of code marker emitted by lamac
+#define CODE_END 0xFF
+
+// Bytecode function: from its BEGIN/CBEGIN up to the next one
+typedef struct {
+    u_int32_t begin;
+    u_int32_t end;
+} function_info;
+
+// Instruction whose result the escape analysis proved never outlives the frame
+typedef enum {
+    FRAME_ARRAY,  // `CALL Barray n` placed in locals of its frame
+    FRAME_RETURN, // `CALL Barray n` returned by END, placed in a region of the caller's frame
+    FRAME_CALL    // `CALL l n` that provides such a region to the callee
+} frame_value_kind;
+
+typedef struct {
+    u_int32_t function;
+    u_int32_t pos;
+    u_int8_t  kind;
+} frame_value;
+
+typedef struct {
+    byte_file     *bf;
+    u_int8_t      *code;
+    u_int32_t      code_size;
+    function_info *functions;
+    u_int32_t      functions_number;
+    frame_value   *frame_values;   // by function
+    u_int32_t      frame_values_number;
+    u_int32_t      frame_values_capacity;
+    int32_t       *return_lengths; // by function: length of the arrays it can return in
+                                   // a region of the caller's frame, -1 if none
+} code_info;
+
+static inline int32_t read_int(const u_int8_t *p) {
+    int32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Original instruction an internal one was rewritten from
+static u_int8_t base_opcode(u_int8_t op) {
+    if (high_bits(op) == BINOP_INT_HIGH_BITS) {
+        return (BINOP_HIGH_BITS << LOW_BITS_COUNT) | low_bits(op);
+    }
+    switch (op) {
+        case BEGIN_LEAF:      return BEGIN;
+        case END_LEAF:        return END;
+        case CJMP_Z_INT:      return CJMP_Z;
+        case CJMP_NZ_INT:     return CJMP_NZ;
+        case ELEM_AGG:        return ELEM;
+        case STA_AGG:         return STA;
+        case CALL_WRITE_INT:  return CALL_WRITE;
+        case CALL_LENGTH_AGG: return CALL_LENGTH;
+        case ELEM_SAFE:       return ELEM;
+        case STA_SAFE:        return STA;
+        case XSTRING_SHARED:  return XSTRING;
+        case BARRAY_FRAME:    return CALL_ARRAY;
+        case BARRAY_RETURN:   return CALL_ARRAY;
+        case CALL_FRAME:      return CALL;
+        case BEGIN_RETURN:    return BEGIN;
+        case CALL_NATIVE:     return CALL;
+        default:              return op;
+    }
+}
+
+// Length of the instruction at `pos` in bytes, 0 if it can't be decoded
+static u_int32_t instr_length(const u_int8_t *code, u_int32_t code_size, u_int32_t pos) {
+    u_int8_t op = base_opcode(code[pos]);
+    u_int32_t len;
+
+    switch (high_bits(op)) {
+        case BINOP_HIGH_BITS:
+        case PATT_HIGH_BITS:
+            len = 1;
+            break;
+        case LD_HIGH_BITS:
+        case LDA_HIGH_BITS:
+        case ST_HIGH_BITS:
+            len = 1 + sizeof(int);
+            break;
+        default:
+            switch (op) {
+                case STI: case STA: case END: case RET:
+                case DROP: case DUP: case SWAP: case ELEM:
+                case CALL_READ: case CALL_WRITE: case CALL_LENGTH: case CALL_STRING:
+                    len = 1;
+                    break;
+                case CONST: case XSTRING: case JMP: case CJMP_Z: case CJMP_NZ:
+                case CALLC: case ARRAY: case LINE: case CALL_ARRAY:
+                    len = 1 + sizeof(int);
+                    break;
+                case SEXP: case BEGIN: case CBEGIN: case CALL: case TAG: case FAIL:
+                    len = 1 + 2 * sizeof(int);
+                    break;
+                case MATCH: case STRING_SWITCH: case STRING_PATT:
+                    // `MATCH table length`, covering `length` bytes of the original code
+                    if (pos + 2 + sizeof(int) > code_size) return 0;
+                    len = code[pos + 1 + sizeof(int)];
+                    if (len < 2 + sizeof(int)) return 0;
+                    break;
+                case CLOSURE: {
+                    // `CLOSURE l n` followed by n pairs of (location byte, index)
+                    if (pos + 1 + 2 * sizeof(int) > code_size) return 0;
+                    int32_t n = read_int(code + pos + 1 + sizeof(int));
+                    if (n < 0 || (u_int32_t) n > (code_size - pos) / (1 + sizeof(int))) return 0;
+                    len = 1 + 2 * sizeof(int) + n * (1 + sizeof(int));
+                    break;
+                }
+                default:
+                    return 0;
+            }
+    }
+
+    if (pos + len > code_size) return 0;
+    return len;
+}
+
+// Splits the code into functions. Returns false if the code can't be decoded,
+// in which case it is left as is.
+static bool collect_functions(code_info *ci) {
+    u_int32_t capacity = 16;
+    ci->functions = (function_info *) malloc(capacity * sizeof(function_info));
+    ci->functions_number = 0;
+    if (!ci->functions) return false;
+
+    u_int32_t pos = 0;
+    while (pos < ci->code_size && ci->code[pos] != CODE_END) {
+        u_int32_t len = instr_length(ci->code, ci->code_size, pos);
+        if (len == 0) return false;
+
+        u_int8_t op = base_opcode(ci->code[pos]);
+        if (op == BEGIN || op == CBEGIN) {
+            if (ci->functions_number > 0) {
+                ci->functions[ci->functions_number - 1].end = pos;
+            }
+            if (ci->functions_number == capacity) {
+                capacity *= 2;
+                function_info *grown = (function_info *) realloc(ci->functions, capacity * sizeof(function_info));
+                if (!grown) return false;
+                ci->functions = grown;
+            }
+            ci->functions[ci->functions_number].begin = pos;
+            ci->functions[ci->functions_number].end = pos;
+            ci->functions_number++;
+        }
+        pos += len;
+    }
+
+    if (ci->functions_number > 0) {
+        ci->functions[ci->functions_number - 1].end = pos;
+    }
+    return true;
+}
+
+// Leaf functions have no locals and make no calls, so no frame is ever pushed
+// on top of theirs: they get BEGIN_LEAF/END_LEAF, which keep the caller frame
+// out of the virtual stack.
+static void mark_leaf_functions(code_info *ci) {
+    for (u_int32_t i = 0; i < ci->functions_number; i++) {
+        function_info *f = &ci->functions[i];
+        u_int8_t *begin = ci->code + f->begin;
+        int32_t n_args = read_int(begin + 1);
+        int32_t n_locals = read_int(begin + 1 + sizeof(int));
+        if (n_args < 0 || n_locals != 0) continue;
+
+        bool leaf = true;
+        u_int32_t pos = f->begin;
+        while (pos < f->end) {
+            u_int8_t op = ci->code[pos];
+            if (op == CALL || op == CALLC) {
+                leaf = false;
+                break;
+            }
+            pos += instr_length(ci->code, ci->code_size, pos);
+        }
+        if (!leaf) continue;
+
+        *begin = BEGIN_LEAF;
+        for (pos = f->begin; pos < f->end; pos += instr_length(ci->code, ci->code_size, pos)) {
+            if (base_opcode(ci->code[pos]) == END) {
+                ci->code[pos] = END_LEAF;
+            }
+        }
+    }
+}
+
+// Kinds of values tracked by the type inference
+typedef enum {
+    KIND_INT,       // unboxed integer
+    KIND_STRING,
+    KIND_ARRAY,
+    KIND_SEXP,
+    KIND_CLOSURE,
+    KIND_AGGREGATE, // string, array or sexp
+    KIND_REF,       // variable reference pushed by LDA
+    KIND_ANY
+} value_kind;
+
+typedef struct {
+    u_int8_t kind;
+    int32_t  tag;    // KIND_SEXP: string table offset of the tag name, -1 if unknown
+    int32_t  length; // KIND_ARRAY, KIND_SEXP: number of elements, -1 if unknown
+} value_type;
+
+// Bounds of an integer value, used to prove array indices in range
+typedef struct {
+    int32_t below;     // exclusive upper bound, NO_BOUND if unknown
+    int16_t below_len; // argument or local whose length is an exclusive upper bound, -1 if none
+    int16_t length_of; // the value is the length of this argument or local, -1 if none
+    bool    nonneg;
+} int_range;
+
+#define NO_BOUND INT32_MAX
+// Small enough for `x + y` of two bounded non-negative values not to overflow
+#define MAX_SMALL_BOUND (1 << 28)
+
+typedef struct {
+    value_type type;
+    int16_t    var;        // argument or local the value was loaded from, while it still holds it; -1 if none
+    int16_t    copy_of;    // stack slot this value was duplicated from, -1 if none
+    int16_t    guard;      // boolean result of a shape test: the tested stack slot, -1 if none
+    value_type guard_type; // type of the `guard` slot if the boolean is true
+    int_range  range;      // KIND_INT: bounds of the value
+    int16_t    cmp_var;    // boolean result of `cmp_var <cmp_op> x`: the compared argument or local, -1 if none
+    u_int8_t   cmp_op;
+    int_range  cmp_bound;  // bounds of `x`
+    u_int32_t  sites;      // allocation sites the value may come from, one bit per site
+} abstract_value;
+
+// Abstract state before an instruction
+typedef struct {
+    int32_t        depth;   // operand stack depth
+    abstract_value slots[]; // arguments, then locals, then the operand stack
+} abstract_state;
+
+#define MAX_ANALYZED_DEPTH 256
+// Allocation sites tracked by the escape analysis: `CALL Barray n`, `CALL l n`
+// and `STRING s`
+#define MAX_SITES 32
+// Extra locals a function may get for values that don't escape its frame
+#define MAX_FRAME_WORDS 64
+
+typedef struct {
+    code_info       *ci;
+    function_info   *f;
+    int32_t          n_args;
+    int32_t          n_vars;     // arguments and locals
+    bool             track_vars; // no LDA of arguments and locals, so only ST changes them
+    bool             has_refs;   // the function has LDA instructions
+    u_int8_t        *starts;     // instruction starts by offset from the function begin
+    abstract_state **states;     // in-states by offset from the function begin
+    abstract_state  *scratch;
+    abstract_state  *branch;     // second scratch state for the other successor of CJMP
+    u_int32_t       *worklist;
+    u_int32_t        worklist_size;
+    u_int8_t        *queued;
+    u_int32_t        sites[MAX_SITES]; // offsets of the allocation sites
+    u_int32_t        sites_number;
+} function_analysis;
+
+static inline value_type make_type(value_kind kind, int32_t tag, int32_t length) {
+    value_type t = {kind, tag, length};
+    return t;
+}
+
+static inline int_range unknown_range(void) {
+    int_range r = {NO_BOUND, -1, -1, false};
+    return r;
+}
+
+static inline int_range const_range(int32_t c) {
+    int_range r = {c < NO_BOUND ? c + 1 : NO_BOUND, -1, -1, c >= 0};
+    return r;
+}
+
+static inline abstract_value make_value(value_type type) {
+    abstract_value v;
+    v.type = type;
+    v.var = -1;
+    v.copy_of = -1;
+    v.guard = -1;
+    v.guard_type = make_type(KIND_ANY, -1, -1);
+    v.range = unknown_range();
+    v.cmp_var = -1;
+    v.cmp_op = 0;
+    v.cmp_bound = unknown_range();
+    v.sites = 0;
+    return v;
+}
+
+static inline bool is_aggregate_kind(u_int8_t kind) {
+    return kind == KIND_STRING || kind == KIND_ARRAY || kind == KIND_SEXP || kind == KIND_AGGREGATE;
+}
+
+static inline bool same_type(value_type a, value_type b) {
+    return a.kind == b.kind && a.tag == b.tag && a.length == b.length;
+}
+
+static value_type join_types(value_type a, value_type b) {
+    if (a.kind == b.kind) {
+        return make_type(a.kind, a.tag == b.tag ? a.tag : -1, a.length == b.length ? a.length : -1);
+    }
+    if (is_aggregate_kind(a.kind) && is_aggregate_kind(b.kind)) {
+        return make_type(KIND_AGGREGATE, -1, -1);
+    }
+    return make_type(KIND_ANY, -1, -1);
+}
+
+static inline bool same_range(int_range a, int_range b) {
+    return a.below == b.below && a.below_len == b.below_len && a.length_of == b.length_of && a.nonneg == b.nonneg;
+}
+
+// Constant bounds only come from CONST and narrowing by comparisons, so taking
+// the larger one on join still reaches a fixpoint
+static int_range join_ranges(int_range a, int_range b) {
+    int_range r;
+    r.below = a.below > b.below ? a.below : b.below;
+    r.below_len = a.below_len == b.below_len ? a.below_len : -1;
+    r.length_of = a.length_of == b.length_of ? a.length_of : -1;
+    r.nonneg = a.nonneg && b.nonneg;
+    return r;
+}
+
+static abstract_value join_values(abstract_value a, abstract_value b) {
+    abstract_value v = make_value(join_types(a.type, b.type));
+    v.range = join_ranges(a.range, b.range);
+    v.sites = a.sites | b.sites;
+    if (a.cmp_var == b.cmp_var && a.cmp_op == b.cmp_op && same_range(a.cmp_bound, b.cmp_bound)) {
+        v.cmp_var = a.cmp_var;
+        v.cmp_op = a.cmp_op;
+        v.cmp_bound = a.cmp_bound;
+    }
+    if (a.var == b.var) {
+        v.var = a.var;
+    }
+    if (a.copy_of == b.copy_of) {
+        v.copy_of = a.copy_of;
+    }
+    if (a.guard == b.guard && same_type(a.guard_type, b.guard_type)) {
+        v.guard = a.guard;
+        v.guard_type = a.guard_type;
+    }
+    return v;
+}
+
+static inline bool same_value(abstract_value a, abstract_value b) {
+    return same_type(a.type, b.type) && a.var == b.var && a.copy_of == b.copy_of &&
+           a.guard == b.guard && same_type(a.guard_type, b.guard_type) && same_range(a.range, b.range) &&
+           a.cmp_var == b.cmp_var && a.cmp_op == b.cmp_op && same_range(a.cmp_bound, b.cmp_bound) &&
+           a.sites == b.sites;
+}
+
+static inline abstract_value *stack_slot(abstract_state *st, function_analysis *fa, int32_t i) {
+    return &st->slots[fa->n_vars + i];
+}
+
+static inline bool push_value(function_analysis *fa, abstract_value v) {
+    abstract_state *st = fa->scratch;
+    if (st->depth == MAX_ANALYZED_DEPTH) return false;
+    *stack_slot(st, fa, st->depth++) = v;
+    return true;
+}
+
+static inline bool pop_value(function_analysis *fa, abstract_value *v) {
+    abstract_state *st = fa->scratch;
+    if (st->depth == 0) return false;
+    *v = *stack_slot(st, fa, --st->depth);
+    return true;
+}
+
+static inline size_t state_size(function_analysis *fa, int32_t depth) {
+    return sizeof(abstract_state) + (fa->n_vars + depth) * sizeof(abstract_value);
+}
+
+// Joins the scratch state into the in-state of `target` and queues it if it changed
+static bool merge_state(function_analysis *fa, u_int32_t target) {
+    if (target < fa->f->begin || target >= fa->f->end) return false;
+    if (!fa->starts[target - fa->f->begin]) return false;
+
+    abstract_state *src = fa->scratch;
+    u_int32_t idx = target - fa->f->begin;
+    abstract_state *dst = fa->states[idx];
+    bool changed = false;
+
+    if (dst == NULL) {
+        dst = (abstract_state *) malloc(state_size(fa, src->depth));
+        if (!dst) return false;
+        memcpy(dst, src, state_size(fa, src->depth));
+        fa->states[idx] = dst;
+        changed = true;
+    } else {
+        if (dst->depth != src->depth) return false;
+        for (int32_t i = 0; i < fa->n_vars + dst->depth; i++) {
+            abstract_value joined = join_values(dst->slots[i], src->slots[i]);
+            if (!same_value(joined, dst->slots[i])) {
+                dst->slots[i] = joined;
+                changed = true;
+            }
+        }
+    }
+
+    if (changed && !fa->queued[idx]) {
+        fa->queued[idx] = 1;
+        fa->worklist[fa->worklist_size++] = target;
+    }
+    return true;
+}
+
+// Narrows a type with a fact that was checked at run time
+static value_type refine_type(value_type current, value_type fact) {
+    if (current.kind == KIND_ANY) return fact;
+    if (current.kind == KIND_AGGREGATE && is_aggregate_kind(fact.kind)) return fact;
+    return current;
+}
+
+// An operand loaded from a variable passed a run-time type check: the variable
+// and every other copy of its value have that type from now on
+static void refine_operand(function_analysis *fa, abstract_value operand, value_type fact) {
+    abstract_state *st = fa->scratch;
+    if (operand.var < 0) return;
+
+    st->slots[operand.var].type = refine_type(st->slots[operand.var].type, fact);
+    for (int32_t i = 0; i < st->depth; i++) {
+        abstract_value *v = stack_slot(st, fa, i);
+        if (v->var == operand.var) {
+            v->type = refine_type(v->type, fact);
+        }
+    }
+}
+
+// Applies a successful shape test to the tested slot and all its copies
+static void refine_guard(function_analysis *fa, abstract_value cond) {
+    abstract_state *st = fa->scratch;
+    if (cond.guard < 0 || cond.guard >= st->depth) return;
+
+    abstract_value tested = *stack_slot(st, fa, cond.guard);
+    for (int32_t i = cond.guard; i < st->depth; i++) {
+        abstract_value *v = stack_slot(st, fa, i);
+        if (i == cond.guard || v->copy_of == cond.guard) {
+            v->type = cond.guard_type;
+        }
+    }
+    if (tested.var >= 0) {
+        st->slots[tested.var].type = cond.guard_type;
+    }
+}
+
+// Boolean result of a shape test of `tested`
+static abstract_value guard_value(abstract_value tested, value_type type) {
+    abstract_value v = make_value(make_type(KIND_INT, -1, -1));
+    if (tested.copy_of >= 0) {
+        v.guard = tested.copy_of;
+        v.guard_type = type;
+    }
+    return v;
+}
+
+// Slot of a tracked argument or local, -1 for other locations
+static inline int32_t var_index(function_analysis *fa, u_int8_t loc, int32_t index) {
+    if (!fa->track_vars || index < 0) return -1;
+    if (loc == L_ARGUMENT && index < fa->n_args) return index;
+    if (loc == L_LOCAL && index < fa->n_vars - fa->n_args) return fa->n_args + index;
+    return -1;
+}
+
+// Bit of the allocation site at `pos`, 0 if it isn't tracked
+static inline u_int32_t site_bit(function_analysis *fa, u_int32_t pos) {
+    for (u_int32_t i = 0; i < fa->sites_number; i++) {
+        if (fa->sites[i] == pos) return 1u << i;
+    }
+    return 0;
+}
+
+static inline bool has_upper_bound(int_range r) {
+    return r.below != NO_BOUND || r.below_len >= 0 || r.length_of >= 0;
+}
+
+static inline bool is_small(int_range r) {
+    return r.below_len >= 0 || r.length_of >= 0 || r.below <= MAX_SMALL_BOUND;
+}
+
+static inline void forget_length(int_range *r, int32_t var) {
+    if (r->below_len == var) r->below_len = -1;
+    if (r->length_of == var) r->length_of = -1;
+}
+
+// `var` is about to be assigned: drop bounds and comparisons that refer to its old value
+static void forget_var(function_analysis *fa, int32_t var) {
+    abstract_state *st = fa->scratch;
+    for (int32_t i = 0; i < fa->n_vars + st->depth; i++) {
+        abstract_value *v = &st->slots[i];
+        forget_length(&v->range, var);
+        if (v->cmp_var == var || v->cmp_bound.below_len == var || v->cmp_bound.length_of == var) {
+            v->cmp_var = -1;
+        }
+    }
+}
+
+static u_int8_t swap_comparison(u_int8_t op) {
+    switch (op) {
+        case LESS:          return GREATER;
+        case LESS_EQUAL:    return GREATER_EQUAL;
+        case GREATER:       return LESS;
+        case GREATER_EQUAL: return LESS_EQUAL;
+        default:            return op;
+    }
+}
+
+static u_int8_t negate_comparison(u_int8_t op) {
+    switch (op) {
+        case LESS:          return GREATER_EQUAL;
+        case LESS_EQUAL:    return GREATER;
+        case GREATER:       return LESS_EQUAL;
+        case GREATER_EQUAL: return LESS;
+        case EQUAL:         return NOT_EQUAL;
+        default:            return EQUAL;
+    }
+}
+
+// Bounds of the result of an integer BINOP; comparisons also remember their
+// operands so that a conditional jump on the result can narrow them
+static abstract_value binop_result(u_int8_t op, abstract_value a, abstract_value b) {
+    abstract_value v = make_value(make_type(KIND_INT, -1, -1));
+    switch (op) {
+        case PLUS:
+            v.range.nonneg = a.range.nonneg && b.range.nonneg && is_small(a.range) && is_small(b.range);
+            break;
+        case DIVIDE:
+            v.range.nonneg = a.range.nonneg && b.range.nonneg;
+            break;
+        case REMAINDER:
+            // 0 <= a % b < b
+            if (a.range.nonneg && b.range.nonneg) {
+                v.range.nonneg = true;
+                v.range.below = b.range.below == NO_BOUND ? NO_BOUND : b.range.below - 1;
+                v.range.below_len = b.range.length_of >= 0 ? b.range.length_of : b.range.below_len;
+            }
+            break;
+        case LESS:
+        case LESS_EQUAL:
+        case GREATER:
+        case GREATER_EQUAL:
+        case EQUAL:
+        case NOT_EQUAL:
+            // Narrow the variable compared against a bounded value, the left one if both are
+            if (a.var >= 0 && (b.var < 0 || has_upper_bound(b.range) || !has_upper_bound(a.range))) {
+                v.cmp_var = a.var;
+                v.cmp_op = op;
+                v.cmp_bound = b.range;
+            } else if (b.var >= 0) {
+                v.cmp_var = b.var;
+                v.cmp_op = swap_comparison(op);
+                v.cmp_bound = a.range;
+            }
+            // Fall through
+        case AND:
+        case OR:
+            v.range = const_range(1);
+            break;
+        default:
+            break;
+    }
+    return v;
+}
+
+// Narrows the compared variable on the branch where `cond` is `holds`
+static void apply_comparison(function_analysis *fa, abstract_value cond, bool holds) {
+    abstract_state *st = fa->scratch;
+    if (cond.cmp_var < 0) return;
+
+    int32_t var = cond.cmp_var;
+    int_range bound = cond.cmp_bound;
+    int_range r = st->slots[var].range;
+    switch (holds ? cond.cmp_op : negate_comparison(cond.cmp_op)) {
+        case LESS:
+            // var < x < c implies var < c - 1
+            if (bound.below != NO_BOUND && bound.below - 1 < r.below) r.below = bound.below - 1;
+            if (bound.length_of >= 0) r.below_len = bound.length_of;
+            else if (bound.below_len >= 0) r.below_len = bound.below_len;
+            break;
+        case LESS_EQUAL:
+            if (bound.below < r.below) r.below = bound.below;
+            if (bound.below_len >= 0) r.below_len = bound.below_len;
+            break;
+        case GREATER:
+        case GREATER_EQUAL:
+            r.nonneg = r.nonneg || bound.nonneg;
+            break;
+        case EQUAL:
+            if (bound.below < r.below) r.below = bound.below;
+            if (bound.below_len >= 0) r.below_len = bound.below_len;
+            if (bound.length_of >= 0) r.length_of = bound.length_of;
+            r.nonneg = r.nonneg || bound.nonneg;
+            break;
+        default:
+            return;
+    }
+
+    st->slots[var].range = r;
+    for (int32_t i = 0; i < st->depth; i++) {
+        abstract_value *v = stack_slot(st, fa, i);
+        if (v->var == var) v->range = r;
+    }
+}
+
+// The index is within [0, length of obj)
+static bool index_in_bounds(abstract_value index, abstract_value obj) {
+    if (index.type.kind != KIND_INT || !is_aggregate_kind(obj.type.kind) || !index.range.nonneg) return false;
+    if (index.range.below != NO_BOUND && obj.type.length >= 0 && index.range.below <= obj.type.length) return true;
+    return index.range.below_len >= 0 && index.range.below_len == obj.var;
+}
+
+#define POP(v) do { if (!pop_value(fa, &(v))) return false; } while (0)
+#define PUSH(v) do { if (!push_value(fa, (v))) return false; } while (0)
+#define PUSH_TYPE(kind, tag, length) PUSH(make_value(make_type((kind), (tag), (length))))
+
+// Abstract execution of the instruction at `pos` on the scratch state; queues
+// its successors. Returns false if the function can't be analyzed.
+static bool transfer(function_analysis *fa, u_int32_t pos, u_int32_t len) {
+    const u_int8_t *code = fa->ci->code + pos;
+    u_int8_t op = base_opcode(code[0]);
+    abstract_state *st = fa->scratch;
+    abstract_value a, b, c;
+    value_type int_type = make_type(KIND_INT, -1, -1);
+    value_type aggregate_type = make_type(KIND_AGGREGATE, -1, -1);
+    u_int32_t next = pos + len;
+
+    switch (high_bits(op)) {
+        case BINOP_HIGH_BITS:
+            if (low_bits(op) < PLUS || low_bits(op) > OR) return false;
+            POP(b);
+            POP(a);
+            // Everything but == requires integer operands
+            if (low_bits(op) != EQUAL) {
+                refine_operand(fa, a, int_type);
+                refine_operand(fa, b, int_type);
+            }
+            PUSH(binop_result(low_bits(op), a, b));
+            return merge_state(fa, next);
+        case LD_HIGH_BITS: {
+            int32_t var = var_index(fa, low_bits(op), read_int(code + 1));
+            if (var >= 0) {
+                a = make_value(st->slots[var].type);
+                a.var = var;
+                a.range = st->slots[var].range;
+                a.sites = st->slots[var].sites;
+                PUSH(a);
+            } else {
+                PUSH_TYPE(KIND_ANY, -1, -1);
+            }
+            return merge_state(fa, next);
+        }
+        case LDA_HIGH_BITS:
+            PUSH_TYPE(KIND_REF, -1, -1);
+            return merge_state(fa, next);
+        case ST_HIGH_BITS: {
+            if (st->depth == 0) return false;
+            int32_t var = var_index(fa, low_bits(op), read_int(code + 1));
+            if (var >= 0) {
+                forget_var(fa, var);
+                abstract_value *stored = stack_slot(st, fa, st->depth - 1);
+                st->slots[var] = make_value(stored->type);
+                st->slots[var].range = stored->range;
+                st->slots[var].sites = stored->sites;
+                // Values loaded earlier no longer match the variable
+                for (int32_t i = 0; i < st->depth; i++) {
+                    if (stack_slot(st, fa, i)->var == var) stack_slot(st, fa, i)->var = -1;
+                }
+            }
+            return merge_state(fa, next);
+        }
+        case PATT_HIGH_BITS:
+            POP(a);
+            switch (low_bits(op)) {
+                case PATT_STR:
+                    POP(b);
+                    PUSH_TYPE(KIND_INT, -1, -1);
+                    break;
+                case PATT_TAG_STR:     PUSH(guard_value(a, make_type(KIND_STRING, -1, -1))); break;
+                case PATT_TAG_ARR:     PUSH(guard_value(a, make_type(KIND_ARRAY, -1, -1))); break;
+                case PATT_TAG_SEXP:    PUSH(guard_value(a, make_type(KIND_SEXP, -1, -1))); break;
+                case PATT_UNBOXED:     PUSH(guard_value(a, make_type(KIND_INT, -1, -1))); break;
+                case PATT_TAG_CLOSURE: PUSH(guard_value(a, make_type(KIND_CLOSURE, -1, -1))); break;
+                case PATT_BOXED:       PUSH_TYPE(KIND_INT, -1, -1); break;
+                default:               return false;
+            }
+            return merge_state(fa, next);
+        default:
+            break;
+    }
+
+    switch (op) {
+        case CONST:
+            a = make_value(int_type);
+            a.range = const_range(read_int(code + 1));
+            PUSH(a);
+            return merge_state(fa, next);
+        case CALL_READ:
+            PUSH_TYPE(KIND_INT, -1, -1);
+            return merge_state(fa, next);
+        case XSTRING:
+            a = make_value(make_type(KIND_STRING, -1, -1));
+            a.sites = site_bit(fa, pos);
+            PUSH(a);
+            return merge_state(fa, next);
+        case SEXP: {
+            int32_t n = read_int(code + 1 + sizeof(int));
+            if (n < 0) return false;
+            for (int32_t i = 0; i < n; i++) POP(a);
+            PUSH_TYPE(KIND_SEXP, read_int(code + 1), n);
+            return merge_state(fa, next);
+        }
+        case STA:
+            POP(c);
+            POP(b);
+            if (b.type.kind == KIND_REF) {
+                PUSH(make_value(c.type));
+                return merge_state(fa, next);
+            }
+            // Without LDA in the function the index can't be a reference
+            if (b.type.kind != KIND_INT && fa->has_refs) return false;
+            POP(a);
+            refine_operand(fa, a, aggregate_type);
+            refine_operand(fa, b, int_type);
+            PUSH(make_value(c.type));
+            return merge_state(fa, next);
+        case JMP:
+            return merge_state(fa, read_int(code + 1));
+        case END:
+        case FAIL:
+            return true;
+        case DROP:
+            POP(a);
+            return merge_state(fa, next);
+        case DUP: {
+            if (st->depth == 0) return false;
+            int32_t top = st->depth - 1;
+            a = *stack_slot(st, fa, top);
+            if (a.copy_of < 0) a.copy_of = top;
+            PUSH(a);
+            return merge_state(fa, next);
+        }
+        case SWAP:
+            POP(b);
+            POP(a);
+            a.copy_of = b.copy_of = -1;
+            a.guard = b.guard = -1;
+            PUSH(b);
+            PUSH(a);
+            return merge_state(fa, next);
+        case ELEM:
+            POP(b);
+            POP(a);
+            refine_operand(fa, a, aggregate_type);
+            refine_operand(fa, b, int_type);
+            PUSH_TYPE(a.type.kind == KIND_STRING ? KIND_INT : KIND_ANY, -1, -1);
+            return merge_state(fa, next);
+        case CJMP_Z:
+        case CJMP_NZ: {
+            POP(a);
+            refine_operand(fa, a, int_type);
+            u_int32_t target = read_int(code + 1);
+            // The branch taken when the condition holds sees the refined state
+            u_int32_t holds = op == CJMP_NZ ? target : next;
+            u_int32_t fails = op == CJMP_NZ ? next : target;
+            memcpy(fa->branch, st, state_size(fa, st->depth));
+            apply_comparison(fa, a, false);
+            if (!merge_state(fa, fails)) return false;
+            fa->scratch = fa->branch;
+            fa->branch = st;
+            refine_guard(fa, a);
+            apply_comparison(fa, a, true);
+            return merge_state(fa, holds);
+        }
+        case CLOSURE:
+            PUSH_TYPE(KIND_CLOSURE, -1, -1);
+            return merge_state(fa, next);
+        case CALLC: {
+            int32_t n = read_int(code + 1);
+            if (n < 0) return false;
+            for (int32_t i = 0; i <= n; i++) POP(a);
+            PUSH_TYPE(KIND_ANY, -1, -1);
+            return merge_state(fa, next);
+        }
+        case CALL: {
+            int32_t n = read_int(code + 1 + sizeof(int));
+            if (n < 0) return false;
+            for (int32_t i = 0; i < n; i++) POP(a);
+            a = make_value(make_type(KIND_ANY, -1, -1));
+            a.sites = site_bit(fa, pos);
+            PUSH(a);
+            return merge_state(fa, next);
+        }
+        case TAG:
+            POP(a);
+            PUSH(guard_value(a, make_type(KIND_SEXP, read_int(code + 1), read_int(code + 1 + sizeof(int)))));
+            return merge_state(fa, next);
+        case ARRAY:
+            POP(a);
+            PUSH(guard_value(a, make_type(KIND_ARRAY, -1, read_int(code + 1))));
+            return merge_state(fa, next);
+        case LINE:
+            return merge_state(fa, next);
+        case CALL_WRITE:
+            POP(a);
+            refine_operand(fa, a, int_type);
+            PUSH_TYPE(KIND_INT, -1, -1);
+            return merge_state(fa, next);
+        case CALL_LENGTH:
+            POP(a);
+            refine_operand(fa, a, aggregate_type);
+            b = make_value(int_type);
+            b.range.nonneg = true;
+            b.range.length_of = a.var;
+            PUSH(b);
+            return merge_state(fa, next);
+        case CALL_STRING:
+            POP(a);
+            PUSH_TYPE(KIND_STRING, -1, -1);
+            return merge_state(fa, next);
+        case CALL_ARRAY: {
+            int32_t n = read_int(code + 1);
+            if (n < 0) return false;
+            for (int32_t i = 0; i < n; i++) POP(a);
+            a = make_value(make_type(KIND_ARRAY, -1, n));
+            a.sites = site_bit(fa, pos);
+            PUSH(a);
+            return merge_state(fa, next);
+        }
+        default:
+            // BEGIN in the middle of a function, STI, RET and unknown instructions
+            return false;
+    }
+}
+
+#undef POP
+#undef PUSH
+#undef PUSH_TYPE
+
+// Rewrites the instruction at `pos` into its unchecked variant if the in-state
+// proves the operand types
+static void specialize_instruction(function_analysis *fa, u_int32_t pos, abstract_state *st) {
+    u_int8_t *code = fa->ci->code + pos;
+    u_int8_t op = code[0];
+    int32_t depth = st->depth;
+    abstract_value unknown = make_value(make_type(KIND_ANY, -1, -1));
+    abstract_value top_value = depth > 0 ? *stack_slot(st, fa, depth - 1) : unknown;
+    abstract_value second_value = depth > 1 ? *stack_slot(st, fa, depth - 2) : unknown;
+    abstract_value third_value = depth > 2 ? *stack_slot(st, fa, depth - 3) : unknown;
+    value_type top = top_value.type;
+    value_type second = second_value.type;
+    value_type third = third_value.type;
+
+    if (high_bits(op) == BINOP_HIGH_BITS) {
+        if (top.kind == KIND_INT && second.kind == KIND_INT) {
+            code[0] = (BINOP_INT_HIGH_BITS << LOW_BITS_COUNT) | low_bits(op);
+        }
+        return;
+    }
+
+    switch (op) {
+        case CJMP_Z:
+            if (top.kind == KIND_INT) code[0] = CJMP_Z_INT;
+            break;
+        case CJMP_NZ:
+            if (top.kind == KIND_INT) code[0] = CJMP_NZ_INT;
+            break;
+        case ELEM:
+            if (index_in_bounds(top_value, second_value)) code[0] = ELEM_SAFE;
+            else if (top.kind == KIND_INT && is_aggregate_kind(second.kind)) code[0] = ELEM_AGG;
+            break;
+        case STA:
+            if (index_in_bounds(second_value, third_value)) code[0] = STA_SAFE;
+            else if (second.kind == KIND_INT && is_aggregate_kind(third.kind)) code[0] = STA_AGG;
+            break;
+        case CALL_WRITE:
+            if (top.kind == KIND_INT) code[0] = CALL_WRITE_INT;
+            break;
+        case CALL_LENGTH:
+            if (is_aggregate_kind(top.kind)) code[0] = CALL_LENGTH_AGG;
+            break;
+        default:
+            break;
+    }
+}
+
+// Sites of the `n` values on top of the stack
+static u_int32_t top_sites(function_analysis *fa, abstract_state *st, int32_t n) {
+    u_int32_t sites = 0;
+    for (int32_t i = 0; i < n && i < st->depth; i++) {
+        sites |= stack_slot(st, fa, st->depth - 1 - i)->sites;
+    }
+    return sites;
+}
+
+// Sites of the values the instruction at `pos` stores outside of the frame or
+// hands over to code that may keep them
+static u_int32_t escaping_sites(function_analysis *fa, u_int32_t pos, abstract_state *st) {
+    const u_int8_t *code = fa->ci->code + pos;
+    u_int8_t op = base_opcode(code[0]);
+    u_int32_t sites = 0;
+
+    switch (high_bits(op)) {
+        case BINOP_HIGH_BITS:
+        case LD_HIGH_BITS:
+        case LDA_HIGH_BITS:
+        case PATT_HIGH_BITS:
+            return 0;
+        case ST_HIGH_BITS:
+            return var_index(fa, low_bits(op), read_int(code + 1)) >= 0 ? 0 : top_sites(fa, st, 1);
+        default:
+            break;
+    }
+
+    switch (op) {
+        case SEXP:
+            return top_sites(fa, st, read_int(code + 1 + sizeof(int)));
+        case CALL_ARRAY:
+            return top_sites(fa, st, read_int(code + 1));
+        case CALL:
+            return top_sites(fa, st, read_int(code + 1 + sizeof(int)));
+        case CALLC:
+            return top_sites(fa, st, read_int(code + 1) + 1);
+        case STA:
+        case CALL_STRING:
+            return top_sites(fa, st, 1);
+        case CLOSURE:
+            // Captured arguments and locals
+            for (int32_t i = 0; i < fa->n_vars; i++) sites |= st->slots[i].sites;
+            return sites;
+        default:
+            return 0;
+    }
+}
+
+// Escape analysis: finds the arrays built by the function and the results of
+// its calls that never outlive its frame
+static void find_frame_values(function_analysis *fa) {
+    code_info *ci = fa->ci;
+    function_info *f = fa->f;
+    u_int32_t function = f - ci->functions;
+    u_int32_t escaping = 0;       // stored outside of the frame
+    u_int32_t returned = 0;       // returned by END
+    u_int32_t reached = 0;
+    u_int32_t live[MAX_SITES];    // sites of the values the frame holds when a site is reached
+    u_int32_t arrays = 0;
+    int32_t return_length = -1;
+
+    for (u_int32_t pos = f->begin; pos < f->end; pos += instr_length(ci->code, ci->code_size, pos)) {
+        abstract_state *st = fa->states[pos - f->begin];
+        if (!st) continue; // unreachable
+        u_int32_t bit = site_bit(fa, pos);
+        if (bit) {
+            u_int32_t i = __builtin_ctz(bit);
+            reached |= bit;
+            live[i] = 0;
+            for (int32_t j = 0; j < fa->n_vars + st->depth; j++) live[i] |= st->slots[j].sites;
+            if (base_opcode(ci->code[pos]) == CALL_ARRAY) arrays |= bit;
+        }
+        escaping |= escaping_sites(fa, pos, st);
+        if (base_opcode(ci->code[pos]) == END) returned |= top_sites(fa, st, 1);
+    }
+
+    // A region is reused each time its site is reached, so the previous value
+    // must be dead by then; all the returned arrays share the caller's region
+    u_int32_t returned_arrays = returned & arrays & reached;
+    bool returns_in_region = returned_arrays != 0 && (returned_arrays & escaping) == 0 &&
+                             ci->code[f->begin] == BEGIN;
+    for (u_int32_t i = 0; i < fa->sites_number; i++) {
+        u_int32_t bit = 1u << i;
+        if ((returned_arrays & bit) && (live[i] & returned_arrays)) returns_in_region = false;
+        if ((returned_arrays & bit) && read_int(ci->code + fa->sites[i] + 1) > return_length) {
+            return_length = read_int(ci->code + fa->sites[i] + 1);
+        }
+    }
+    ci->return_lengths[function] = returns_in_region ? return_length : -1;
+
+    for (u_int32_t i = 0; i < fa->sites_number; i++) {
+        u_int32_t bit = 1u << i;
+        if (!(reached & bit) || base_opcode(ci->code[fa->sites[i]]) == XSTRING) continue;
+
+        u_int8_t kind;
+        if (returns_in_region && (returned_arrays & bit)) {
+            kind = FRAME_RETURN;
+        } else if ((escaping & bit) || (returned & bit) || (live[i] & bit)) {
+            continue;
+        } else {
+            kind = (arrays & bit) ? FRAME_ARRAY : FRAME_CALL;
+        }
+
+        if (ci->frame_values_number == ci->frame_values_capacity) {
+            u_int32_t capacity = ci->frame_values_capacity ? 2 * ci->frame_values_capacity : 16;
+            frame_value *values = (frame_value *) realloc(ci->frame_values, capacity * sizeof(frame_value));
+            if (!values) return;
+            ci->frame_values = values;
+            ci->frame_values_capacity = capacity;
+        }
+        frame_value *v = &ci->frame_values[ci->frame_values_number++];
+        v->function = function;
+        v->pos = fa->sites[i];
+        v->kind = kind;
+    }
+}
+
+// Each evaluation of a `STRING s` makes a new string, as the program may write
+// to it. Literals that are never written to nor leave the frame of the
+// function may share a single object instead. Only literals within the string
+// table are shared: XSTRING_SHARED indexes the literal cache with its operand.
+static void share_string_literals(function_analysis *fa) {
+    code_info *ci = fa->ci;
+    function_info *f = fa->f;
+    u_int32_t kept = 0; // written to, stored outside of the frame or returned
+
+    for (u_int32_t pos = f->begin; pos < f->end; pos += instr_length(ci->code, ci->code_size, pos)) {
+        abstract_state *st = fa->states[pos - f->begin];
+        if (!st) continue; // unreachable
+        kept |= escaping_sites(fa, pos, st);
+        switch (base_opcode(ci->code[pos])) {
+            case STA:
+                // The value stored through a reference is counted by escaping_sites
+                if (st->depth > 2 && stack_slot(st, fa, st->depth - 2)->type.kind != KIND_REF) {
+                    kept |= stack_slot(st, fa, st->depth - 3)->sites;
+                }
+                break;
+            case END:
+                kept |= top_sites(fa, st, 1);
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (u_int32_t i = 0; i < fa->sites_number; i++) {
+        u_int32_t pos = fa->sites[i];
+        if ((kept & (1u << i)) || ci->code[pos] != XSTRING) continue;
+        if ((u_int32_t) read_int(ci->code + pos + 1) < (u_int32_t) ci->bf->string_table_size) {
+            ci->code[pos] = XSTRING_SHARED;
+        }
+    }
+}
+
+// Marks instruction starts and looks for references taken by LDA
+static void scan_function(function_analysis *fa) {
+    code_info *ci = fa->ci;
+    fa->track_vars = true;
+    fa->has_refs = false;
+    fa->sites_number = 0;
+    for (u_int32_t pos = fa->f->begin; pos < fa->f->end; pos += instr_length(ci->code, ci->code_size, pos)) {
+        u_int8_t op = ci->code[pos];
+        fa->starts[pos - fa->f->begin] = 1;
+        if ((op == CALL_ARRAY || op == CALL || op == XSTRING) && fa->sites_number < MAX_SITES) {
+            fa->sites[fa->sites_number++] = pos;
+        }
+        if (high_bits(op) == LDA_HIGH_BITS) {
+            fa->has_refs = true;
+            if (low_bits(op) == L_LOCAL || low_bits(op) == L_ARGUMENT) {
+                fa->track_vars = false;
+            }
+        }
+    }
+}
+
+// Type inference: abstract interpretation of a function over value kinds of
+// its arguments, locals and operand stack. Instructions whose operand types
+// are proven get unchecked variants.
+static void infer_types(code_info *ci, function_info *f) {
+    const u_int8_t *begin = ci->code + f->begin;
+    int32_t n_args = read_int(begin + 1);
+    int32_t n_locals = read_int(begin + 1 + sizeof(int));
+    if (n_args < 0 || n_locals < 0 || n_args > MAX_ANALYZED_DEPTH || n_locals > MAX_ANALYZED_DEPTH) return;
+
+    u_int32_t size = f->end - f->begin;
+    function_analysis fa;
+    fa.ci = ci;
+    fa.f = f;
+    fa.n_args = n_args;
+    fa.n_vars = n_args + n_locals;
+    fa.starts = (u_int8_t *) calloc(size, 1);
+    fa.states = (abstract_state **) calloc(size, sizeof(abstract_state *));
+    fa.scratch = (abstract_state *) malloc(state_size(&fa, MAX_ANALYZED_DEPTH));
+    fa.branch = (abstract_state *) malloc(state_size(&fa, MAX_ANALYZED_DEPTH));
+    fa.worklist = (u_int32_t *) malloc(size * sizeof(u_int32_t));
+    fa.worklist_size = 0;
+    fa.queued = (u_int8_t *) calloc(size, 1);
+
+    bool ok = fa.starts && fa.states && fa.scratch && fa.branch && fa.worklist && fa.queued;
+    if (ok) {
+        scan_function(&fa);
+
+        // Arguments are unknown, locals start as BOX(0)
+        fa.scratch->depth = 0;
+        for (int32_t i = 0; i < fa.n_vars; i++) {
+            fa.scratch->slots[i] = make_value(make_type(i < n_args ? KIND_ANY : KIND_INT, -1, -1));
+            if (i >= n_args) fa.scratch->slots[i].range = const_range(0);
+        }
+        u_int32_t entry = f->begin + instr_length(ci->code, ci->code_size, f->begin);
+        ok = entry < f->end && merge_state(&fa, entry);
+    }
+
+    while (ok && fa.worklist_size > 0) {
+        u_int32_t pos = fa.worklist[--fa.worklist_size];
+        u_int32_t idx = pos - f->begin;
+        fa.queued[idx] = 0;
+        memcpy(fa.scratch, fa.states[idx], state_size(&fa, fa.states[idx]->depth));
+        ok = transfer(&fa, pos, instr_length(ci->code, ci->code_size, pos));
+    }
+
+    if (ok) {
+        for (u_int32_t idx = 0; idx < size; idx++) {
+            if (fa.states[idx]) {
+                specialize_instruction(&fa, f->begin + idx, fa.states[idx]);
+            }
+        }
+    }
+    if (ok) share_string_literals(&fa);
+    if (ok && ci->return_lengths) find_frame_values(&fa);
+
+    if (fa.states) {
+        for (u_int32_t idx = 0; idx < size; idx++) free(fa.states[idx]);
+    }
+    free(fa.starts);
+    free(fa.states);
+    free(fa.scratch);
+    free(fa.branch);
+    free(fa.worklist);
+    free(fa.queued);
+}
+
+static int32_t function_at(code_info *ci, u_int32_t pos) {
+    for (u_int32_t i = 0; i < ci->functions_number; i++) {
+        if (ci->functions[i].begin == pos) return i;
+    }
+    return -1;
+}
+
+static inline void write_int(u_int8_t *p, int32_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+// Gives the values found by the escape analysis regions in extra locals of
+// their frames. A region is addressed by its local with the lowest address,
+// which holds the header.
+static void allocate_frame_values(code_info *ci) {
+    u_int32_t v = 0;
+    for (u_int32_t function = 0; function < ci->functions_number; function++) {
+        u_int8_t *begin = ci->code + ci->functions[function].begin;
+        int32_t n_locals = read_int(begin + 1 + sizeof(int));
+        int32_t locals = n_locals;
+        bool returns_in_region = ci->return_lengths[function] >= 0;
+        // The region given by the caller is kept in the last local
+        int32_t region_local = -1;
+
+        for (; v < ci->frame_values_number && ci->frame_values[v].function == function; v++) {
+            frame_value *value = &ci->frame_values[v];
+            u_int8_t *code = ci->code + value->pos;
+            int32_t length;
+            switch (value->kind) {
+                case FRAME_ARRAY:
+                    length = read_int(code + 1);
+                    break;
+                case FRAME_CALL: {
+                    int32_t callee = function_at(ci, read_int(code + 1));
+                    if (callee < 0 || ci->return_lengths[callee] < 0) continue;
+                    length = ci->return_lengths[callee];
+                    break;
+                }
+                default:
+                    continue;
+            }
+            if (locals - n_locals + length + 1 > MAX_FRAME_WORDS) continue;
+
+            locals += length + 1;
+            int32_t operand = ((locals - 1) << 16) | read_int(code + 1 + (value->kind == FRAME_CALL ? sizeof(int) : 0));
+            if (value->kind == FRAME_ARRAY) {
+                code[0] = BARRAY_FRAME;
+                write_int(code + 1, operand);
+            } else {
+                code[0] = CALL_FRAME;
+                write_int(code + 1 + sizeof(int), operand);
+            }
+        }
+
+        if (returns_in_region) {
+            region_local = locals++;
+            *begin = BEGIN_RETURN;
+            for (u_int32_t r = 0; r < ci->frame_values_number; r++) {
+                frame_value *value = &ci->frame_values[r];
+                if (value->function != function || value->kind != FRAME_RETURN) continue;
+                u_int8_t *code = ci->code + value->pos;
+                code[0] = BARRAY_RETURN;
+                write_int(code + 1, (region_local << 16) | read_int(code + 1));
+            }
+        }
+        write_int(begin + 1 + sizeof(int), locals);
+    }
+}
+
+match_table *match_tables = NULL;
+static u_int32_t match_tables_number = 0;
+static u_int32_t match_tables_capacity = 0;
+
+// Offsets that control can reach other than by falling through
+static u_int8_t *collect_targets(code_info *ci) {
+    u_int8_t *targets = (u_int8_t *) calloc(ci->code_size + 1, 1);
+    if (!targets) return NULL;
+
+    for (u_int32_t i = 0; i < ci->functions_number; i++) {
+        targets[ci->functions[i].begin] = 1;
+    }
+    u_int32_t pos = 0;
+    while (pos < ci->code_size && ci->code[pos] != CODE_END) {
+        u_int8_t op = base_opcode(ci->code[pos]);
+        u_int32_t target = ci->code_size;
+        if (op == JMP || op == CJMP_Z || op == CJMP_NZ || op == CALL || op == CLOSURE) {
+            target = read_int(ci->code + pos + 1);
+        }
+        if (target < ci->code_size) targets[target] = 1;
+        pos += instr_length(ci->code, ci->code_size, pos);
+    }
+    return targets;
+}
+
+static bool has_inner_target(const u_int8_t *targets, u_int32_t pos, u_int32_t len) {
+    for (u_int32_t i = pos + 1; i < pos + len; i++) {
+        if (targets[i]) return true;
+    }
+    return false;
+}
+
+// Constructor names have at most five significant characters of this alphabet
+static bool is_tag_name(const byte_file *bf, int32_t offset) {
+    if (offset < 0 || offset >= bf->string_table_size) return false;
+    const char *name = bf->string_ptr + offset;
+    const char *end = memchr(name, 0, bf->string_table_size - offset);
+    if (!end || end == name) return false;
+    for (const char *c = name; c < end; c++) {
+        if (!(*c == '_' || *c == '\'' || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+              (*c >= '0' && *c <= '9'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decodes `DUP; test; CJMPnz l` at `pos` into a case. Returns the offset after
+// it, 0 if there is no such sequence.
+static u_int32_t decode_match_head(code_info *ci, u_int32_t pos, match_case *c) {
+    if (instr_length(ci->code, ci->code_size, pos) == 0 || base_opcode(ci->code[pos]) != DUP) return 0;
+
+    u_int32_t test = pos + 1;
+    u_int32_t test_len = instr_length(ci->code, ci->code_size, test);
+    if (test_len == 0) return 0;
+    u_int8_t op = base_opcode(ci->code[test]);
+    c->tag = -1;
+    c->length = -1;
+    if (op == TAG) {
+        int32_t name = read_int(ci->code + test + 1);
+        if (!is_tag_name(ci->bf, name)) return 0;
+        c->test = MATCH_SEXP;
+        c->tag = LtagHash(ci->bf->string_ptr + name) >> 1; // as stored in sexps
+        c->length = read_int(ci->code + test + 1 + sizeof(int));
+    } else if (op == ARRAY) {
+        c->test = MATCH_ARRAY;
+        c->length = read_int(ci->code + test + 1);
+    } else if (high_bits(op) == PATT_HIGH_BITS) {
+        switch (low_bits(op)) {
+            case PATT_TAG_STR:     c->test = MATCH_STRING_TAG; break;
+            case PATT_TAG_ARR:     c->test = MATCH_ARRAY_TAG; break;
+            case PATT_TAG_SEXP:    c->test = MATCH_SEXP_TAG; break;
+            case PATT_BOXED:       c->test = MATCH_BOXED; break;
+            case PATT_UNBOXED:     c->test = MATCH_UNBOXED; break;
+            case PATT_TAG_CLOSURE: c->test = MATCH_CLOSURE_TAG; break;
+            default:               return 0;
+        }
+    } else {
+        return 0;
+    }
+
+    u_int32_t jump = test + test_len;
+    if (instr_length(ci->code, ci->code_size, jump) == 0 || base_opcode(ci->code[jump]) != CJMP_NZ) return 0;
+    c->target = read_int(ci->code + jump + 1);
+    return jump + 1 + sizeof(int);
+}
+
+// Decodes the `DROP; JMP l` that follows a failed test
+static bool decode_match_failure(code_info *ci, u_int32_t pos, u_int32_t *target) {
+    if (pos + 2 + sizeof(int) > ci->code_size) return false;
+    if (base_opcode(ci->code[pos]) != DROP || base_opcode(ci->code[pos + 1]) != JMP) return false;
+    *target = read_int(ci->code + pos + 2);
+    return true;
+}
+
+// Decodes an arm of a `case` at `pos`: `DUP; DUP; test; CJMPnz l; DROP; JMP next`.
+// Returns the offset after the test, 0 if there is no arm.
+static u_int32_t decode_match_arm(code_info *ci, u_int32_t pos, match_case *c, u_int32_t *next) {
+    if (pos >= ci->code_size || base_opcode(ci->code[pos]) != DUP) return 0;
+    u_int32_t end = decode_match_head(ci, pos + 1, c);
+    if (end == 0 || !decode_match_failure(ci, end, next)) return 0;
+    return end;
+}
+
+static bool add_match_case(match_table *table, match_case c) {
+    match_case *grown = (match_case *) realloc(table->cases, (table->cases_number + 1) * sizeof(match_case));
+    if (!grown) return false;
+    grown[table->cases_number++] = c;
+    table->cases = grown;
+    return true;
+}
+
+// Builds the table of the match at `pos`. Returns the number of bytes it
+// replaces, 0 if there is no match.
+static u_int32_t build_match_table(code_info *ci, u_int32_t pos, match_table *table) {
+    match_case c;
+    u_int32_t next;
+    table->cases_number = 0;
+    table->cases = NULL;
+
+    // Arms of a `case` jump to the next arm on failure: collect the whole chain
+    u_int32_t end = decode_match_arm(ci, pos, &c, &next);
+    if (end != 0) {
+        table->keep_value = true;
+        u_int32_t arm = pos;
+        do {
+            if (!add_match_case(table, c)) {
+                free(table->cases);
+                return 0;
+            }
+            table->otherwise = next;
+            // Arms follow each other in the code
+            if (next <= arm) break;
+            arm = next;
+        } while (decode_match_arm(ci, arm, &c, &next) != 0);
+        return end - pos;
+    }
+
+    // A nested test consumes its value on failure
+    end = decode_match_head(ci, pos, &c);
+    if (end != 0 && decode_match_failure(ci, end, &next)) {
+        table->keep_value = false;
+        table->otherwise = next;
+        return add_match_case(table, c) ? end - pos : 0;
+    }
+    return 0;
+}
+
+// Replaces the test chains of pattern matching by MATCH instructions. A MATCH
+// reads the header of the value once and jumps right to the arm that matches.
+static void fuse_matches(code_info *ci, const u_int8_t *targets) {
+    u_int32_t pos = 0;
+    while (pos < ci->code_size && ci->code[pos] != CODE_END) {
+        u_int32_t len = instr_length(ci->code, ci->code_size, pos);
+        match_table table;
+        u_int32_t covered = base_opcode(ci->code[pos]) == DUP ? build_match_table(ci, pos, &table) : 0;
+
+        if (covered == 0 || covered > 0xFF || has_inner_target(targets, pos, covered)) {
+            if (covered != 0) free(table.cases);
+            pos += len;
+            continue;
+        }
+
+        if (match_tables_number == match_tables_capacity) {
+            u_int32_t capacity = match_tables_capacity ? 2 * match_tables_capacity : 16;
+            match_table *grown = (match_table *) realloc(match_tables, capacity * sizeof(match_table));
+            if (!grown) {
+                free(table.cases);
+                break;
+            }
+            match_tables = grown;
+            match_tables_capacity = capacity;
+        }
+
+        int32_t index = match_tables_number;
+        match_tables[match_tables_number++] = table;
+        ci->code[pos] = MATCH;
+        memcpy(ci->code + pos + 1, &index, sizeof(index));
+        ci->code[pos + 1 + sizeof(int)] = (u_int8_t) covered;
+        pos += covered;
+    }
+}
+
+string_switch *string_switches = NULL;
+static u_int32_t string_switches_number = 0;
+static u_int32_t string_switches_capacity = 0;
+
+// String literal at `offset` of the string table, NULL if it isn't terminated
+static const char *literal_at(const byte_file *bf, int32_t offset) {
+    if (offset < 0 || offset >= bf->string_table_size) return NULL;
+    const char *s = bf->string_ptr + offset;
+    return memchr(s, 0, bf->string_table_size - offset) ? s : NULL;
+}
+
+// Decodes `STRING s; PATT =str` at `pos`
+static const char *decode_string_test(code_info *ci, u_int32_t pos) {
+    if (pos + 2 + sizeof(int) > ci->code_size) return NULL;
+    if (base_opcode(ci->code[pos]) != XSTRING) return NULL;
+    if (base_opcode(ci->code[pos + 1 + sizeof(int)]) != ((PATT_HIGH_BITS << LOW_BITS_COUNT) | PATT_STR)) return NULL;
+    return literal_at(ci->bf, read_int(ci->code + pos + 1));
+}
+
+// Decodes an arm of a `case` on a string literal at `pos`: `DUP; STRING s;
+// PATT =str; CJMPz next`. Returns the offset of the arm body, 0 if there is no arm.
+static u_int32_t decode_string_arm(code_info *ci, u_int32_t pos, const char **literal, u_int32_t *next) {
+    if (pos >= ci->code_size || base_opcode(ci->code[pos]) != DUP) return 0;
+    *literal = decode_string_test(ci, pos + 1);
+    u_int32_t jump = pos + 1 + 2 + sizeof(int);
+    if (*literal == NULL || jump + 1 + sizeof(int) > ci->code_size) return 0;
+    if (base_opcode(ci->code[jump]) != CJMP_Z) return 0;
+    *next = read_int(ci->code + jump + 1);
+    return jump + 1 + sizeof(int);
+}
+
+// Adds a literal to the hash table of a switch; the first arm of equal literals wins
+static void add_string_case(string_switch *sw, const char *literal, u_int32_t target) {
+    u_int32_t length;
+    u_int32_t hash = string_hash(literal, UINT32_MAX, &length);
+    for (u_int32_t i = hash & sw->mask;; i = (i + 1) & sw->mask) {
+        string_case *c = &sw->buckets[i];
+        if (c->chars == NULL) {
+            c->chars = literal;
+            c->length = length;
+            c->hash = hash;
+            c->target = target;
+            return;
+        }
+        if (c->hash == hash && c->length == length && memcmp(c->chars, literal, length) == 0) return;
+    }
+}
+
+// Builds the switch over the literals of the arms starting at `pos`
+static bool build_string_switch(code_info *ci, u_int32_t pos, string_switch *sw) {
+    const char *literal;
+    u_int32_t next, arms = 0;
+    for (u_int32_t arm = pos; decode_string_arm(ci, arm, &literal, &next) != 0 && next > arm; arm = next) {
+        arms++;
+    }
+    if (arms == 0) arms = 1;
+
+    // At most half full
+    u_int32_t buckets = 2;
+    while (buckets < 2 * arms) buckets *= 2;
+    sw->mask = buckets - 1;
+    sw->buckets = (string_case *) calloc(buckets, sizeof(string_case));
+    if (!sw->buckets) return false;
+
+    u_int32_t arm = pos;
+    for (u_int32_t i = 0; i < arms; i++) {
+        u_int32_t body = decode_string_arm(ci, arm, &literal, &next);
+        add_string_case(sw, literal, body);
+        sw->otherwise = next;
+        arm = next;
+    }
+    return true;
+}
+
+static bool add_string_switch(string_switch sw, int32_t *index) {
+    if (string_switches_number == string_switches_capacity) {
+        u_int32_t capacity = string_switches_capacity ? 2 * string_switches_capacity : 16;
+        string_switch *grown = (string_switch *) realloc(string_switches, capacity * sizeof(string_switch));
+        if (!grown) return false;
+        string_switches = grown;
+        string_switches_capacity = capacity;
+    }
+    *index = string_switches_number;
+    string_switches[string_switches_number++] = sw;
+    return true;
+}
+
+// Replaces matching against string literals, which allocates the literal and
+// compares it with strcmp, by a lookup in a hash table of the literals:
+// chains of `case` arms become STRING_SWITCH, single tests STRING_PATT
+static void fuse_string_matches(code_info *ci, const u_int8_t *targets) {
+    u_int32_t pos = 0;
+    while (pos < ci->code_size && ci->code[pos] != CODE_END) {
+        u_int32_t len = instr_length(ci->code, ci->code_size, pos);
+        const char *literal;
+        u_int32_t next;
+        u_int8_t op = 0;
+        u_int32_t covered = 0;
+        u_int32_t body = decode_string_arm(ci, pos, &literal, &next);
+        if (body != 0) {
+            op = STRING_SWITCH;
+            covered = body - pos;
+        } else if (decode_string_test(ci, pos) != NULL) {
+            op = STRING_PATT;
+            covered = 2 + sizeof(int);
+        }
+        if (covered == 0 || has_inner_target(targets, pos, covered)) {
+            pos += len;
+            continue;
+        }
+
+        string_switch sw;
+        int32_t index;
+        if (op == STRING_SWITCH) {
+            if (!build_string_switch(ci, pos, &sw)) break;
+        } else {
+            sw.mask = 0;
+            sw.buckets = (string_case *) calloc(1, sizeof(string_case));
+            if (!sw.buckets) break;
+            add_string_case(&sw, decode_string_test(ci, pos), 0);
+            sw.otherwise = 0;
+        }
+        if (!add_string_switch(sw, &index)) {
+            free(sw.buckets);
+            break;
+        }
+
+        ci->code[pos] = op;
+        memcpy(ci->code + pos + 1, &index, sizeof(index));
+        ci->code[pos + 1 + sizeof(int)] = (u_int8_t) covered;
+        pos += covered;
+    }
+}
+
+// The bytecode format has no imports, and lamac only compiles calls of
+// functions defined in the program. A public function named after a runtime
+// intrinsic, e.g. `public fun listReverse (l)` for `LlistReverse`, is taken as
+// its definition in Lama: the reference interpreter runs it, while calls of it
+// here go to the native table. Its body is kept for closures made of it.
+// Functions named after other runtime functions, e.g. `length`, are the
+// program's own and keep their Lama semantics.
+static int32_t public_native(const byte_file *bf, u_int32_t offset, int32_t n_args) {
+    for (int32_t i = 0; i < bf->public_symbols_number; i++) {
+        if (get_public_offset(bf, i) != offset) continue;
+
+        const char *name = get_public_name(bf, i);
+        char symbol[64];
+        // Public symbols may be listed either as declared or as their labels
+        if (snprintf(symbol, sizeof(symbol), name[0] == 'L' ? "%s" : "L%s", name) >= (int) sizeof(symbol)) {
+            continue;
+        }
+        int32_t index = find_intrinsic(symbol, n_args);
+        if (index >= 0) return index;
+    }
+    return -1;
+}
+
+// Binds calls of public functions named after runtime intrinsics to their
+// entries in the native table
+static void resolve_natives(code_info *ci) {
+    if (ci->bf->public_symbols_number == 0) return;
+
+    u_int32_t pos = 0;
+    while (pos < ci->code_size && ci->code[pos] != CODE_END) {
+        u_int32_t len = instr_length(ci->code, ci->code_size, pos);
+        if (len == 0) return;
+
+        if (ci->code[pos] == CALL) {
+            int32_t offset = read_int(ci->code + pos + 1);
+            int32_t n_args = read_int(ci->code + pos + 1 + sizeof(int));
+            int32_t index = offset >= 0 ? public_native(ci->bf, offset, n_args) : -1;
+            if (index >= 0) {
+                ci->code[pos] = CALL_NATIVE;
+                write_int(ci->code + pos + 1, index);
+            }
+        }
+        pos += len;
+    }
+}
+
+void optimize_bytecode(byte_file *bf) {
+    code_info ci;
+    ci.bf = bf;
+    ci.code = (u_int8_t *) bf->code_ptr;
+    ci.code_size = bf->code_size;
+    ci.frame_values = NULL;
+    ci.frame_values_number = 0;
+    ci.frame_values_capacity = 0;
+    ci.return_lengths = NULL;
+
+    if (collect_functions(&ci)) {
+        ci.return_lengths = (int32_t *) malloc(ci.functions_number * sizeof(int32_t));
+        for (u_int32_t i = 0; ci.return_lengths && i < ci.functions_number; i++) ci.return_lengths[i] = -1;
+        for (u_int32_t i = 0; i < ci.functions_number; i++) {
+            infer_types(&ci, &ci.functions[i]);
+        }
+        if (ci.return_lengths) allocate_frame_values(&ci);
+        mark_leaf_functions(&ci);
+
+        // Fusions change instruction boundaries, so jump targets are collected beforehand
+        u_int8_t *targets = collect_targets(&ci);
+        if (targets) {
+            fuse_matches(&ci, targets);
+            fuse_string_matches(&ci, targets);
+            free(targets);
+        }
+    }
+
+    // The passes above saw calls of runtime functions as calls of their definitions in Lama
+    resolve_natives(&ci);
+
+    free(ci.functions);
+    free(ci.frame_values);
+    free(ci.return_lengths);
+}
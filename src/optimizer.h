@@ -0,0 +1,72 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdbool.h>
+#include "byte_file.h"
+
+// Shape tests a MATCH can perform
+typedef enum {
+    MATCH_SEXP,        // `TAG t n`
+    MATCH_ARRAY,       // `ARRAY n`
+    MATCH_STRING_TAG,  // `PATT #string`
+    MATCH_ARRAY_TAG,   // `PATT #array`
+    MATCH_SEXP_TAG,    // `PATT #sexp`
+    MATCH_BOXED,       // `PATT #ref`
+    MATCH_UNBOXED,     // `PATT #val`
+    MATCH_CLOSURE_TAG  // `PATT #fun`
+} match_test;
+
+typedef struct {
+    u_int8_t  test;
+    int32_t   tag;    // MATCH_SEXP: hash of the constructor name
+    int32_t   length; // MATCH_SEXP, MATCH_ARRAY: number of elements
+    u_int32_t target; // code offset of the arm
+} match_case;
+
+// Decision table of a MATCH: the first case whose test succeeds on the value
+// on top of the stack is taken
+typedef struct {
+    bool        keep_value;   // arms of a `case`: the matched value is duplicated for the arm, and stays
+                              // on the stack if nothing matches; otherwise it is consumed on failure
+    u_int32_t   cases_number;
+    match_case *cases;
+    u_int32_t   otherwise;    // code offset taken when no case matches
+} match_table;
+
+// Tables of MATCH instructions, indexed by their operand
+extern match_table *match_tables;
+
+typedef struct {
+    const char *chars;  // NULL for an empty bucket
+    u_int32_t   length;
+    u_int32_t   hash;
+    u_int32_t   target; // code offset of the arm
+} string_case;
+
+// Open-addressing hash table of the string literals of STRING_SWITCH and
+// STRING_PATT; the latter has a single case
+typedef struct {
+    u_int32_t    mask;    // number of buckets - 1
+    string_case *buckets;
+    u_int32_t    otherwise; // code offset taken when no literal matches
+} string_switch;
+
+// Tables of STRING_SWITCH and STRING_PATT instructions, indexed by their operand
+extern string_switch *string_switches;
+
+// FNV-1a hash of a string up to its terminator or `max_length` bytes; stores its length
+static inline u_int32_t string_hash(const char *s, u_int32_t max_length, u_int32_t *length) {
+    u_int32_t hash = 2166136261u;
+    u_int32_t i = 0;
+    for (; i < max_length && s[i]; i++) {
+        hash = (hash ^ (u_int8_t) s[i]) * 16777619u;
+    }
+    *length = i;
+    return hash;
+}
+
+// Rewrites the loaded bytecode in place into the interpreter's internal
+// instruction set. All rewrites preserve instruction lengths and offsets.
+void optimize_bytecode(byte_file *bf);
+
+#endif
@@ -57,3 +57,27 @@ F,flatCompare;
 F,tagHash;
 F,uppercase;
 F,lowercase;
+F,hashMap;
+F,hashMapSize;
+F,hashMapFind;
+F,hashMapInsert;
+F,hashMapRemove;
+F,hashMapEntries;
+F,listLength;
+F,listNth;
+F,listReverse;
+F,listAppend;
+F,listArray;
+F,arrayList;
+F,makeArrayOf;
+F,arrayFill;
+F,arrayBlit;
+F,arraySum;
+F,arrayMin;
+F,arrayMax;
+F,arrayMap;
+F,arrayFold;
+F,sortArray;
+F,sortArrayBy;
+F,sortList;
+F,sortListBy;
@@ -21,17 +21,11 @@ void print_indent (void) {
 
 extern size_t __gc_stack_top, __gc_stack_bottom;
 
-/* GC pool structure and data; declared here in order to allow debug print */
-typedef struct {
-  size_t * begin;
-  size_t * end;
-  size_t * current;
-  size_t   size;
-} pool;
-
+/* GC pool data; declared here in order to allow debug print */
 static pool from_space;
 static pool to_space;
 size_t      *current;
+static int   replicating = 0; /* an incremental collection is under way */
 /* end */
 
 # ifdef __ENABLE_GC__
@@ -169,6 +163,7 @@ typedef struct {
 
 extern void* alloc    (size_t);
 extern void* Bsexp    (int n, ...);
+static void  remember_new_object (void *obj, size_t bytes);
 extern int   LtagHash (char*);
 
 void *global_sysargs;
@@ -211,7 +206,10 @@ void* Ls__Infix_58 (void *p, void *q) {
 
   push_extra_root(&p);
   push_extra_root(&q);
-  res = Bsexp (BOX(3), p, q, LtagHash ("cons")); //BOX(848787));
+  // Bsexp reads its fields after allocating, when p and q may have moved
+  res = Bsexp (BOX(3), BOX(0), BOX(0), LtagHash ("cons")); //BOX(848787));
+  ((void**) res)[0] = p;
+  ((void**) res)[1] = q;
   pop_extra_root(&q);
   pop_extra_root(&p);
 
@@ -707,6 +705,7 @@ void *Lclone (void *p) {
 #endif
       obj = (data*) alloc (sizeof(int) * (l+1));
       memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
+      remember_new_object (obj->contents, sizeof(int) * (l+1));
       res = (void*) (obj->contents);
       break;
 
@@ -716,6 +715,7 @@ void *Lclone (void *p) {
 #endif
       sobj = (sexp*) alloc (sizeof(int) * (l+2));
       memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
+      remember_new_object (sobj->contents.contents, sizeof(int) * (l+2));
       res = (void*) sobj->contents.contents;
       break;
 
@@ -912,6 +912,7 @@ extern void* LmakeArray (int length) {
   r = (data*) alloc (sizeof(int) * (n+1));
 
   r->tag = ARRAY_TAG | (n << 3);
+  remember_new_object (r->contents, sizeof(int) * (n+1));
 
   p = (int*) r->contents;
   while (n--) *p++ = BOX(0);
@@ -1027,6 +1028,7 @@ extern void* Bclosure (int bn, void *entry, ...) {
   r = (data*) alloc (sizeof(int) * (n+2));
 
   r->tag = CLOSURE_TAG | ((n + 1) << 3);
+  remember_new_object (r->contents, sizeof(int) * (n+2));
   ((void**) r->contents)[0] = entry;
 
   va_start(args, entry);
@@ -1069,6 +1071,7 @@ extern void* Barray (int bn, ...) {
   r = (data*) alloc (sizeof(int) * (n+1));
 
   r->tag = ARRAY_TAG | (n << 3);
+  remember_new_object (r->contents, sizeof(int) * (n+1));
 
   va_start(args, bn);
 
@@ -1106,6 +1109,7 @@ extern void* Bsexp (int bn, ...) {
   r->tag = 0;
 
   d->tag = SEXP_TAG | ((n-1) << 3);
+  remember_new_object (d->contents, sizeof(int) * (n+1));
 
   va_start(args, bn);
 
@@ -1210,13 +1214,22 @@ extern void* Bsta (void *v, int i, void *x) {
     ASSERT_BOXED(".sta:3", x);
     //    ASSERT_UNBOXED(".sta:2", i);
 
-    if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
-    else ((int*) x)[UNBOX(i)] = (int) v;
+    if (TAG(TO_DATA(x)->tag) == STRING_TAG) {
+      ((char*) x)[UNBOX(i)] = (char) UNBOX(v);
+      gc_write_barrier (x, (char*) x + UNBOX(i), v);
+    }
+    else {
+      ((int*) x)[UNBOX(i)] = (int) v;
+      gc_write_barrier (x, (int*) x + UNBOX(i), v);
+    }
 
     return v;
   }
 
-  * (void**) x = v;
+  /* i is a reference to a variable, which is a field of x if it is
+     captured by a closure, and x is NULL if it is not known */
+  * (void**) i = v;
+  gc_write_barrier (x, (void*) i, v);
 
   return v;
 }
@@ -1507,6 +1520,496 @@ extern int Ltime () {
   return BOX(t.tv_sec * 1000000 + t.tv_nsec / 1000);
 }
 
+/* Hash maps */
+
+/* A hash map is HashMap (count, used, buckets), where buckets is an array of
+   key/value pairs with open addressing and linear probing. Keys are hashed
+   by Lhash and compared by Lcompare. Free slots have EMPTY_KEY as the key and
+   slots of removed keys DELETED_KEY; neither is a value nor a heap pointer,
+   so the buckets are traced as any other array. */
+# define EMPTY_KEY             0
+# define DELETED_KEY           2
+# define HASH_MAP_MIN_CAPACITY 8
+
+# define HASH_MAP_COUNT(m)   (((int*) (m))[0])
+# define HASH_MAP_USED(m)    (((int*) (m))[1])
+# define HASH_MAP_BUCKETS(m) (((int**) (m))[2])
+# define HASH_MAP_CAPACITY(b) (LEN(TO_DATA(b)->tag) / 2)
+
+static int hash_map_tag = 0;
+
+static void assert_hash_map (char *memo, void *m) {
+  if (hash_map_tag == 0) hash_map_tag = UNBOX(LtagHash ("HashMap"));
+
+  if (UNBOXED(m) || TAG(TO_DATA(m)->tag) != SEXP_TAG || TO_SEXP(m)->tag != hash_map_tag)
+    failure ("hash map expected in %s\n", memo);
+}
+
+static int* hash_map_buckets (int capacity) {
+  data *r = (data*) alloc (sizeof(int) * (2 * capacity + 1));
+
+  r->tag = ARRAY_TAG | ((2 * capacity) << 3);
+  remember_new_object (r->contents, sizeof(int) * (2 * capacity + 1));
+  memset (r->contents, 0, sizeof(int) * 2 * capacity);
+
+  return (int*) r->contents;
+}
+
+/* The slot holding key, or the one to insert it into */
+static int hash_map_slot (int *buckets, void *key) {
+  int mask   = HASH_MAP_CAPACITY(buckets) - 1;
+  int i      = UNBOX(Lhash (key)) & mask;
+  int insert = -1;
+
+  for (;; i = (i + 1) & mask) {
+    int k = buckets[2 * i];
+
+    if (k == EMPTY_KEY) return insert >= 0 ? insert : i;
+    if (k == DELETED_KEY) {
+      if (insert < 0) insert = i;
+    }
+    else if (Lcompare ((void*) k, key) == BOX(0)) return i;
+  }
+}
+
+static int hash_map_has_key (int *buckets, int slot) {
+  int k = buckets[2 * slot];
+
+  return k != EMPTY_KEY && k != DELETED_KEY;
+}
+
+/* Rehashes into buckets at most half full; *m must be a root */
+static void hash_map_resize (int **m) {
+  int  count    = UNBOX(HASH_MAP_COUNT(*m));
+  int  capacity = HASH_MAP_MIN_CAPACITY;
+  int *buckets, *old, i;
+
+  while (capacity < 2 * (count + 1)) capacity *= 2;
+
+  buckets = hash_map_buckets (capacity);
+  old     = HASH_MAP_BUCKETS(*m);
+
+  for (i = 0; i < HASH_MAP_CAPACITY(old); i++) {
+    if (hash_map_has_key (old, i)) {
+      int slot = hash_map_slot (buckets, (void*) old[2 * i]);
+
+      buckets[2 * slot]     = old[2 * i];
+      buckets[2 * slot + 1] = old[2 * i + 1];
+    }
+  }
+
+  HASH_MAP_BUCKETS(*m) = buckets;
+  gc_write_barrier (*m, &HASH_MAP_BUCKETS(*m), buckets);
+  HASH_MAP_USED(*m)    = BOX(count);
+}
+
+extern void* LhashMap () {
+  int *buckets, *m;
+
+  __pre_gc ();
+
+  buckets = hash_map_buckets (HASH_MAP_MIN_CAPACITY);
+  push_extra_root ((void**) &buckets);
+  m = (int*) Bsexp (BOX(4), BOX(0), BOX(0), BOX(0), LtagHash ("HashMap"));
+  pop_extra_root ((void**) &buckets);
+  HASH_MAP_BUCKETS(m) = buckets;
+
+  __post_gc ();
+
+  return m;
+}
+
+extern int LhashMapSize (void *m) {
+  assert_hash_map ("hashMapSize:1", m);
+
+  return HASH_MAP_COUNT(m);
+}
+
+/* The value of key, or def if there is none */
+extern void* LhashMapFind (void *m, void *key, void *def) {
+  int *buckets, slot;
+
+  assert_hash_map ("hashMapFind:1", m);
+
+  buckets = HASH_MAP_BUCKETS(m);
+  slot    = hash_map_slot (buckets, key);
+
+  return hash_map_has_key (buckets, slot) ? (void*) buckets[2 * slot + 1] : def;
+}
+
+extern void* LhashMapInsert (void *m, void *key, void *value) {
+  int *buckets, slot;
+
+  assert_hash_map ("hashMapInsert:1", m);
+
+  __pre_gc ();
+
+  buckets = HASH_MAP_BUCKETS(m);
+  slot    = hash_map_slot (buckets, key);
+
+  if (!hash_map_has_key (buckets, slot)) {
+    if (buckets[2 * slot] == EMPTY_KEY &&
+        4 * (UNBOX(HASH_MAP_USED(m)) + 1) > 3 * HASH_MAP_CAPACITY(buckets)) {
+      push_extra_root (&m);
+      push_extra_root (&key);
+      push_extra_root (&value);
+      hash_map_resize ((int**) &m);
+      pop_extra_root (&value);
+      pop_extra_root (&key);
+      pop_extra_root (&m);
+
+      buckets = HASH_MAP_BUCKETS(m);
+      slot    = hash_map_slot (buckets, key);
+    }
+
+    if (buckets[2 * slot] == EMPTY_KEY) HASH_MAP_USED(m) = BOX(UNBOX(HASH_MAP_USED(m)) + 1);
+    HASH_MAP_COUNT(m)  = BOX(UNBOX(HASH_MAP_COUNT(m)) + 1);
+    gc_write_barrier (m, &HASH_MAP_COUNT(m), (void*) HASH_MAP_COUNT(m));
+    buckets[2 * slot]  = (int) key;
+    gc_write_barrier (buckets, &buckets[2 * slot], key);
+  }
+  buckets[2 * slot + 1] = (int) value;
+  gc_write_barrier (buckets, &buckets[2 * slot + 1], value);
+
+  __post_gc ();
+
+  return m;
+}
+
+extern void* LhashMapRemove (void *m, void *key) {
+  int *buckets, slot;
+
+  assert_hash_map ("hashMapRemove:1", m);
+
+  buckets = HASH_MAP_BUCKETS(m);
+  slot    = hash_map_slot (buckets, key);
+
+  if (hash_map_has_key (buckets, slot)) {
+    buckets[2 * slot]     = DELETED_KEY;
+    buckets[2 * slot + 1] = 0;
+    HASH_MAP_COUNT(m)     = BOX(UNBOX(HASH_MAP_COUNT(m)) - 1);
+    gc_write_barrier (buckets, &buckets[2 * slot], (void*) DELETED_KEY);
+    gc_write_barrier (m, &HASH_MAP_COUNT(m), (void*) HASH_MAP_COUNT(m));
+  }
+
+  return m;
+}
+
+/* The list of [key, value] pairs of a hash map */
+extern void* LhashMapEntries (void *m) {
+  void *list = (void*) BOX(0), *pair = NULL;
+  int   i;
+
+  assert_hash_map ("hashMapEntries:1", m);
+
+  __pre_gc ();
+
+  push_extra_root (&m);
+  push_extra_root (&list);
+  push_extra_root (&pair);
+
+  for (i = HASH_MAP_CAPACITY(HASH_MAP_BUCKETS(m)) - 1; i >= 0; i--) {
+    int *cell;
+
+    if (!hash_map_has_key (HASH_MAP_BUCKETS(m), i)) continue;
+
+    pair = LmakeArray (BOX(2));
+    ((int*) pair)[0] = HASH_MAP_BUCKETS(m)[2 * i];
+    ((int*) pair)[1] = HASH_MAP_BUCKETS(m)[2 * i + 1];
+
+    cell = (int*) Bsexp (BOX(3), BOX(0), BOX(0), LtagHash ("cons"));
+    cell[0] = (int) pair;
+    cell[1] = (int) list;
+    list = cell;
+  }
+
+  pop_extra_root (&pair);
+  pop_extra_root (&list);
+  pop_extra_root (&m);
+
+  __post_gc ();
+
+  return list;
+}
+
+/* Lists */
+
+/* A list is a chain of cons (head, tail) cells ending in BOX(0). Results are
+   allocated in blocks of up to LIST_BLOCK_CELLS cells, so building them takes
+   few allocs. A block stays below NURSERY_OBJECT_SIZE words: the large object
+   space holds one object per mapping and would not scan the other cells. */
+# define CONS_WORDS 4 /* hash of the tag, header, head and tail */
+# define LIST_BLOCK_CELLS 1024
+# define LIST_CELL(first, i) ((int*) (first) + (i) * CONS_WORDS)
+
+static int cons_tag = 0;
+
+/* The length of the list l */
+static int assert_list (char *memo, void *l) {
+  int n = 0;
+
+  if (cons_tag == 0) cons_tag = UNBOX(LtagHash ("cons"));
+
+  for (; !UNBOXED(l); l = ((void**) l)[1], n++) {
+    if (TAG(TO_DATA(l)->tag) != SEXP_TAG || TO_SEXP(l)->tag != cons_tag)
+      failure ("list expected in %s\n", memo);
+  }
+
+  return n;
+}
+
+/* n > 0 chained cells ending in BOX(0). The blocks are allocated from the
+   last one, so a collection between them only leaves younger cells pointing
+   to older ones. If reversed is not NULL, the heads are the elements of the
+   list in the root *reversed, which is consumed, in reverse order; otherwise
+   they are BOX(0) and are to be set with set_head. */
+static int* alloc_list (int n, void **reversed) {
+  void *rest = (void*) BOX(0);
+
+  push_extra_root (&rest);
+
+  while (n > 0) {
+    int   m = n < LIST_BLOCK_CELLS ? n : LIST_BLOCK_CELLS, i;
+    sexp *r = (sexp*) alloc (sizeof(int) * CONS_WORDS * m);
+    int  *first = (int*) r->contents.contents;
+
+    for (i = m - 1; i >= 0; i--) {
+      int *cell = LIST_CELL(first, i);
+
+      TO_SEXP(cell)->tag  = cons_tag;
+      TO_DATA(cell)->tag  = SEXP_TAG | (2 << 3);
+      cell[1] = i == m - 1 ? (int) rest : (int) LIST_CELL(first, i + 1);
+      if (reversed == NULL) cell[0] = BOX(0);
+      else {
+        cell[0]   = ((int*) *reversed)[0];
+        *reversed = ((void**) *reversed)[1];
+      }
+    }
+
+    rest = first;
+    n   -= m;
+  }
+
+  pop_extra_root (&rest);
+
+  return (int*) rest;
+}
+
+/* Sets the head of a cell made by alloc_list, which a collection during the
+   allocation of the blocks before it may have promoted */
+static void set_head (int *cell, int v) {
+  cell[0] = v;
+  gc_write_barrier (cell, cell, (void*) v);
+}
+
+extern int LlistLength (void *l) {
+  return BOX(assert_list ("listLength:1", l));
+}
+
+extern void* LlistNth (void *l, int i) {
+  int n = assert_list ("listNth:1", l), k;
+
+  ASSERT_UNBOXED("listNth:2", i);
+
+  if (UNBOX(i) < 0 || UNBOX(i) >= n)
+    failure ("index %d out of list bounds 0..%d in listNth\n", UNBOX(i), n - 1);
+
+  for (k = UNBOX(i); k > 0; k--) l = ((void**) l)[1];
+
+  return ((void**) l)[0];
+}
+
+extern void* LlistReverse (void *l) {
+  int  n = assert_list ("listReverse:1", l);
+  int *first;
+
+  if (n < 2) return l;
+
+  __pre_gc ();
+
+  push_extra_root (&l);
+  first = alloc_list (n, &l);
+  pop_extra_root (&l);
+
+  __post_gc ();
+
+  return first;
+}
+
+extern void* LlistAppend (void *a, void *b) {
+  int  n = assert_list ("listAppend:1", a), i;
+  int *first, *cell;
+
+  assert_list ("listAppend:2", b);
+
+  if (n == 0) return b;
+
+  __pre_gc ();
+
+  push_extra_root (&a);
+  push_extra_root (&b);
+  first = alloc_list (n, NULL);
+  pop_extra_root (&b);
+  pop_extra_root (&a);
+
+  for (i = 0, cell = first; i < n - 1; i++, a = ((void**) a)[1], cell = (int*) cell[1])
+    set_head (cell, ((int*) a)[0]);
+  set_head (cell, ((int*) a)[0]);
+  cell[1] = (int) b;
+  gc_write_barrier (cell, cell + 1, b);
+
+  __post_gc ();
+
+  return first;
+}
+
+extern void* LlistArray (void *l) {
+  int  n = assert_list ("listArray:1", l), i;
+  int *a;
+
+  __pre_gc ();
+
+  push_extra_root (&l);
+  a = (int*) LmakeArray (BOX(n));
+  pop_extra_root (&l);
+
+  for (i = 0; i < n; i++, l = ((void**) l)[1]) a[i] = ((int*) l)[0];
+
+  __post_gc ();
+
+  return a;
+}
+
+extern void* LarrayList (void *a) {
+  int  n, i;
+  int *first, *cell;
+
+  if (UNBOXED(a) || TAG(TO_DATA(a)->tag) != ARRAY_TAG)
+    failure ("array expected in arrayList\n");
+
+  n = LEN(TO_DATA(a)->tag);
+
+  if (n == 0) return (void*) BOX(0);
+  if (cons_tag == 0) cons_tag = UNBOX(LtagHash ("cons"));
+
+  __pre_gc ();
+
+  push_extra_root (&a);
+  first = alloc_list (n, NULL);
+  pop_extra_root (&a);
+
+  for (i = 0, cell = first; i < n; i++, cell = (int*) cell[1]) set_head (cell, ((int*) a)[i]);
+
+  __post_gc ();
+
+  return first;
+}
+
+/* Arrays */
+
+/* The loops below work on the words of the arrays directly and are kept
+   branch-free, so that the compiler can vectorise them. */
+
+/* The length of the array a */
+static int assert_array (char *memo, void *a) {
+  if (UNBOXED(a) || TAG(TO_DATA(a)->tag) != ARRAY_TAG)
+    failure ("array expected in %s\n", memo);
+
+  return LEN(TO_DATA(a)->tag);
+}
+
+/* The length of the array a of integers */
+static int assert_int_array (char *memo, void *a) {
+  int *p = (int*) a, n = assert_array (memo, a), i, boxed = 1;
+
+  for (i = 0; i < n; i++) boxed &= p[i];
+
+  if (!boxed) failure ("array of integers expected in %s\n", memo);
+
+  return n;
+}
+
+static void fill_words (int *p, int n, int v) {
+  int i;
+
+  for (i = 0; i < n; i++) p[i] = v;
+}
+
+extern void* LmakeArrayOf (int length, void *v) {
+  int *a;
+
+  ASSERT_UNBOXED("makeArrayOf:1", length);
+
+  __pre_gc ();
+
+  push_extra_root (&v);
+  a = (int*) LmakeArray (length);
+  pop_extra_root (&v);
+
+  fill_words (a, UNBOX(length), (int) v);
+
+  __post_gc ();
+
+  return a;
+}
+
+extern void* LarrayFill (void *a, void *v) {
+  fill_words ((int*) a, assert_array ("arrayFill:1", a), (int) v);
+  gc_remember_object (a);
+
+  return a;
+}
+
+/* Copies len elements of src from src_pos to dst from dst_pos; the ranges may overlap */
+extern void* LarrayBlit (void *src, int src_pos, void *dst, int dst_pos, int len) {
+  int src_n = assert_array ("arrayBlit:1", src);
+  int dst_n = assert_array ("arrayBlit:3", dst);
+
+  ASSERT_UNBOXED("arrayBlit:2", src_pos);
+  ASSERT_UNBOXED("arrayBlit:4", dst_pos);
+  ASSERT_UNBOXED("arrayBlit:5", len);
+
+  src_pos = UNBOX(src_pos);
+  dst_pos = UNBOX(dst_pos);
+  len     = UNBOX(len);
+
+  if (len < 0 || src_pos < 0 || dst_pos < 0 || src_pos > src_n - len || dst_pos > dst_n - len)
+    failure ("arrayBlit: range out of bounds\n");
+
+  memmove ((int*) dst + dst_pos, (int*) src + src_pos, sizeof(int) * len);
+  gc_remember_object (dst);
+
+  return dst;
+}
+
+extern int LarraySum (void *a) {
+  int *p = (int*) a, n = assert_int_array ("arraySum:1", a), i, sum = 0;
+
+  for (i = 0; i < n; i++) sum += UNBOX(p[i]);
+
+  return BOX(sum);
+}
+
+extern int LarrayMin (void *a) {
+  int *p = (int*) a, n = assert_int_array ("arrayMin:1", a), i, m;
+
+  if (n == 0) failure ("arrayMin: empty array\n");
+
+  for (m = p[0], i = 1; i < n; i++) m = p[i] < m ? p[i] : m;
+
+  return m;
+}
+
+extern int LarrayMax (void *a) {
+  int *p = (int*) a, n = assert_int_array ("arrayMax:1", a), i, m;
+
+  if (n == 0) failure ("arrayMax: empty array\n");
+
+  for (m = p[0], i = 1; i < n; i++) m = p[i] > m ? p[i] : m;
+
+  return m;
+}
+
 extern void set_args (int argc, char *argv[]) {
   data *a;
   int n = argc, *p = NULL;
@@ -1531,6 +2034,7 @@ extern void set_args (int argc, char *argv[]) {
     printf ("set_args: iteration %i %p %p ->\n", i, &p, p); fflush(stdout);
 #endif
     ((int*)p) [i] = (int) Bstring (argv[i]);
+    gc_write_barrier (p, (int*)p + i, (void*) ((int*)p) [i]);
 #ifdef DEBUG_PRINT
     print_indent ();
     printf ("set_args: iteration %i <- %p %p\n", i, &p, p); fflush(stdout);
@@ -1576,281 +2080,1513 @@ void __gc_init_subst () {}
 
 extern void __gc_root_scan_stack ();
 
+static void (*stack_root_scanner) (void) = NULL;
+
+extern void gc_set_stack_root_scanner (void (*scanner) (void)) {
+  stack_root_scanner = scanner;
+}
+
+static void gc_root_scan_program_stack (void) {
+  if (stack_root_scanner != NULL) stack_root_scanner ();
+  else __gc_root_scan_stack ();
+}
+
 /* ======================================== */
 /*           Mark-and-copy                  */
 /* ======================================== */
 
+/* Heap sizing: the semispaces start at SPACE_SIZE words and are resized
+   after each major collection. They grow by SPACE_GROWTH when collections
+   take too large a share of the run time or the live data fills too much of
+   the space, and shrink back, down to the initial size, when both are low.
+   The environment variables LAMA_HEAP_SIZE and LAMA_HEAP_MAX (in MiB) and
+   LAMA_HEAP_GROWTH override the defaults; MAX_SPACE_SIZE 0 is no limit. */
 //static size_t SPACE_SIZE = 16;
-static size_t SPACE_SIZE = 256 * 1024 * 1024;
+static size_t SPACE_SIZE = 4 * 1024 * 1024;
 // static size_t SPACE_SIZE = 128;
 // static size_t SPACE_SIZE = 1024 * 1024;
+static size_t MIN_SPACE_SIZE = 0;
+static size_t MAX_SPACE_SIZE = 0;
+static double SPACE_GROWTH   = 2.0;
 
-static int free_pool (pool * p) {
-  size_t *a = p->begin, b = p->size;
-  p->begin   = NULL;
-  p->size    = 0;
-  p->end     = NULL;
-  p->current = NULL;
-  return munmap((void *)a, b);
-}
+/* Size of the nursery (see below); bigger objects, in words, are allocated
+   in the large object space */
+static size_t NURSERY_SIZE = 256 * 1024;
+static size_t NURSERY_OBJECT_SIZE = 32 * 1024;
 
-static void init_to_space (int flag) {
-  size_t space_size = 0;
-  if (flag) SPACE_SIZE = SPACE_SIZE << 1;
-  space_size     = SPACE_SIZE * sizeof(size_t);
-  to_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
-			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-  if (to_space.begin == MAP_FAILED) {
-    perror ("EROOR: init_to_space: mmap failed\n");
-    exit   (1);
-  }
-  to_space.current = to_space.begin;
-  to_space.end     = to_space.begin + SPACE_SIZE;
-  to_space.size    = SPACE_SIZE;
-}
+/* Shares of the run time spent in collections that make the heap grow and shrink */
+# define GC_TIME_RATIO_HIGH 0.10
+# define GC_TIME_RATIO_LOW  0.02
 
-static void gc_swap_spaces (void) {
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("gc_swap_spaces\n"); fflush (stdout);
-#endif
-  free_pool (&from_space);
-  from_space.begin   = to_space.begin;
-  from_space.current = current;
-  from_space.end     = to_space.end;
-  from_space.size    = to_space.size;
-  to_space.begin   = NULL;
-  to_space.current = NULL;
-  to_space.end     = NULL;
-  to_space.size    = 0;
-#ifdef DEBUG_PRINT
-  indent--;
-#endif
+static double last_gc_end = 0;
+
+static double gc_clock (void) {
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec + t.tv_nsec * 1e-9;
 }
 
-# define IS_VALID_HEAP_POINTER(p)\
-  (!UNBOXED(p) &&		 \
-   (size_t)from_space.begin <= (size_t)p &&	 \
-   (size_t)from_space.end   >  (size_t)p)
+/* With LAMA_GC_STATS set to a file name, the numbers of collections of
+   each kind are written to that file at exit, a "name number" line each,
+   for the tests to check which collectors a run went through */
+enum { MINOR_GCS, MAJOR_GCS, PARALLEL_GCS, INCREMENTAL_FLIPS, COMPACTIONS,
+       MOVED_OBJECTS /* of the old space, by compactions */, GC_COUNTERS };
 
-# define IN_PASSIVE_SPACE(p)	\
-  ((size_t)to_space.begin <= (size_t)p	&&	\
-   (size_t)to_space.end   >  (size_t)p)
+static size_t      gc_counts[GC_COUNTERS];
+static const char *gc_counter_names[GC_COUNTERS] =
+  {"minor", "major", "parallel", "flips", "compactions", "moved"};
+static char       *gc_stats_file = NULL;
 
-# define IS_FORWARD_PTR(p)			\
-  (!UNBOXED(p) && IN_PASSIVE_SPACE(p))
+static void write_gc_stats (void) {
+  FILE *f = fopen (gc_stats_file, "w");
+  int   i;
 
-int is_valid_heap_pointer (void *p)  {
-  return IS_VALID_HEAP_POINTER(p);
+  if (f == NULL) {
+    perror ("ERROR: write_gc_stats: fopen failed\n");
+    return;
+  }
+  for (i = 0; i < GC_COUNTERS; i++) fprintf (f, "%s %zu\n", gc_counter_names[i], gc_counts[i]);
+  fclose (f);
 }
 
-extern size_t * gc_copy (size_t *obj);
+static void init_gc_stats (void) {
+  gc_stats_file = getenv ("LAMA_GC_STATS");
+  if (gc_stats_file != NULL && *gc_stats_file != 0) atexit (write_gc_stats);
+}
 
-static void copy_elements (size_t *where, size_t *from, int len) {
-  int    i = 0;
-  void * p = NULL;
+# define HEAP_LIMIT_FAILURE()						\
+  failure ("heap limit of %zu MiB exceeded\n", MAX_SPACE_SIZE / (1024 * 1024 / sizeof (size_t)))
+
+/* words clamped to MAX_SPACE_SIZE; fails if that leaves less than needed */
+static size_t limited_space_size (size_t words, size_t needed) {
+  if (MAX_SPACE_SIZE == 0) return words;
+  if (needed > MAX_SPACE_SIZE) HEAP_LIMIT_FAILURE ();
+
+  return words > MAX_SPACE_SIZE ? MAX_SPACE_SIZE : words;
+}
+
+static size_t grown_space_size (size_t size) {
+  size_t grown = (size_t) (size * SPACE_GROWTH);
+
+  if (grown <= size) grown = size + 1;
+
+  return limited_space_size (grown, 0);
+}
+
+/* A size in MiB from the environment, in words */
+static size_t heap_size_from_env (char *var, size_t def) {
+  char          *e = getenv (var), *end = NULL;
+  unsigned long  mb;
+
+  if (e == NULL || *e == 0) return def;
+
+  mb = strtoul (e, &end, 10);
+  if (*end != 0 || mb == 0) failure ("%s: positive number of MiB expected, got %s\n", var, e);
+
+  return mb * (1024 * 1024 / sizeof (size_t));
+}
+
+static void init_heap_sizing (void) {
+  char *e = getenv ("LAMA_HEAP_GROWTH"), *end = NULL;
+
+  SPACE_SIZE     = heap_size_from_env ("LAMA_HEAP_SIZE", SPACE_SIZE);
+  MAX_SPACE_SIZE = heap_size_from_env ("LAMA_HEAP_MAX", MAX_SPACE_SIZE);
+
+  if (e != NULL && *e != 0) {
+    SPACE_GROWTH = strtod (e, &end);
+    if (*end != 0 || !(SPACE_GROWTH > 1))
+      failure ("LAMA_HEAP_GROWTH: factor greater than 1 expected, got %s\n", e);
+  }
+
+  if (MAX_SPACE_SIZE && SPACE_SIZE > MAX_SPACE_SIZE) SPACE_SIZE = MAX_SPACE_SIZE;
+  /* Room for the nursery reserve and then some */
+  if (SPACE_SIZE < 4 * NURSERY_SIZE) SPACE_SIZE = 4 * NURSERY_SIZE;
+  if (MAX_SPACE_SIZE && SPACE_SIZE > MAX_SPACE_SIZE)
+    failure ("LAMA_HEAP_MAX: at least %zu MiB expected\n", SPACE_SIZE / (1024 * 1024 / sizeof (size_t)));
+
+  MIN_SPACE_SIZE = SPACE_SIZE;
+  last_gc_end    = gc_clock ();
+}
+
+/* Both semispaces stay mapped for the whole run and are flipped by the
+   collections; size is the number of words mapped, of which the space uses
+   those up to end. Pages are only given back by a shrink of the heap. */
+# define PAGE_WORDS (4096 / sizeof(size_t))
+
+static int free_pool (pool * p) {
+  size_t *a = p->begin, b = p->size * sizeof(size_t);
+  p->begin   = NULL;
+  p->size    = 0;
+  p->end     = NULL;
+  p->current = NULL;
+  return munmap((void *)a, b);
+}
+
+/* Releases the pages of p beyond its first words */
+static void release_pool_pages (pool * p, size_t words) {
+  words = (words + PAGE_WORDS - 1) / PAGE_WORDS * PAGE_WORDS;
+  if (p->begin != NULL && words < p->size)
+    madvise (p->begin + words, (p->size - words) * sizeof(size_t), MADV_DONTNEED);
+}
+
+static size_t parallel_gc_room (size_t used);
+
+static void init_to_space (int flag) {
+  size_t space_size = 0;
+  size_t words      = 0, needed = 0, mapped = 0;
+  if (flag) SPACE_SIZE = grown_space_size (SPACE_SIZE);
+  /* All of the old space and the nursery may survive; the old space fills
+     up further while it is being replicated, and takes in the nursery
+     before the replication is finished */
+  if (replicating) needed = from_space.end - from_space.begin;
+  else needed = from_space.current - from_space.begin + (nursery.current - nursery.begin);
+  words = limited_space_size (needed < SPACE_SIZE ? SPACE_SIZE : needed, needed);
+  /* A parallel copy needs more room, for the buffer tails it leaves behind;
+     the pages it does not touch cost nothing */
+  mapped = words;
+  if (!replicating && limited_space_size (parallel_gc_room (needed), 0) > mapped)
+    mapped = limited_space_size (parallel_gc_room (needed), 0);
+  if (to_space.begin != NULL && to_space.size < mapped) free_pool (&to_space);
+  if (to_space.begin == NULL) {
+    space_size     = mapped * sizeof(size_t);
+    to_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (to_space.begin == MAP_FAILED) {
+      perror ("EROOR: init_to_space: mmap failed\n");
+      exit   (1);
+    }
+    to_space.size = mapped;
+  }
+  to_space.current = to_space.begin;
+  to_space.end     = to_space.begin + words;
+}
+
+static void gc_swap_spaces (void) {
+  pool old = from_space;
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
-  printf ("copy_elements: start; len = %d\n", len); fflush (stdout);
+  printf ("gc_swap_spaces\n"); fflush (stdout);
 #endif
-  for (i = 0; i < len; i++) {
-    size_t elem = from[i];
-    if (!IS_VALID_HEAP_POINTER(elem)) {
-      *where = elem;
-      where++;
+  from_space.begin   = to_space.begin;
+  from_space.current = current;
+  from_space.end     = to_space.end;
+  from_space.size    = to_space.size;
+  to_space.begin   = old.begin;
+  to_space.current = NULL;
+  to_space.end     = old.end;
+  to_space.size    = old.size;
 #ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("copy_elements: copy NON ptr: %zu %p \n", elem, elem); fflush (stdout);
+  indent--;
 #endif
+}
+
+# define IN_OLD_SPACE(p)			\
+  ((size_t)from_space.begin <= (size_t)p &&	\
+   (size_t)from_space.end   >  (size_t)p)
+
+# define IS_VALID_HEAP_POINTER(p)\
+  (!UNBOXED(p) && (IN_OLD_SPACE(p) || IN_NURSERY(p)))
+
+# define IN_PASSIVE_SPACE(p)	\
+  ((size_t)to_space.begin <= (size_t)p	&&	\
+   (size_t)to_space.end   >  (size_t)p)
+
+/* Objects are copied into the old space by a minor collection, and into
+   to_space by a major one */
+# define IS_FORWARD_PTR(p)			\
+  (!UNBOXED(p) && (minor_collection ? IN_OLD_SPACE(p) : IN_PASSIVE_SPACE(p)))
+
+/* Objects moved by the current collection */
+# define IS_COLLECTED(p)			\
+  (minor_collection ? IN_NURSERY(p) : IS_VALID_HEAP_POINTER(p))
+
+/* ======================================== */
+/*           Large object space             */
+/* ======================================== */
+
+/* Objects of more than NURSERY_OBJECT_SIZE words get mappings of their own,
+   sorted by address, and are never moved. They belong to the old generation:
+   a major collection marks the live ones and scans their fields in place,
+   and the others are unmapped after it. Their constructors remember them,
+   so that minor collections scan the young values they are filled with. A
+   mapping holds a single object, whose header alone is scanned, so blocks of
+   several objects, such as the cells of alloc_list, have to be allocated
+   smaller. */
+typedef struct {
+  size_t *begin;
+  size_t  words;
+  size_t *object; /* the pointer to it, set when marked */
+  int     marked;
+} large_object;
+
+static large_object *large_objects = NULL;
+static size_t        large_objects_number = 0, large_objects_capacity = 0;
+static size_t       *large_space_low = NULL, *large_space_high = NULL;
+
+/* Words allocated in the space since the last major collection, which is
+   forced once they outgrow the old space */
+static size_t large_words_allocated = 0;
+
+/* Marked objects whose fields are still to scan */
+static size_t **large_pending = NULL;
+static size_t   large_pending_number = 0, large_pending_capacity = 0;
+
+static large_object* find_large_object (void *p) {
+  size_t lo = 0, hi = large_objects_number;
+
+  if (UNBOXED(p) || (size_t*) p < large_space_low || (size_t*) p >= large_space_high) return NULL;
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+
+    if ((size_t*) p < large_objects[mid].begin) hi = mid;
+    else if ((size_t*) p >= large_objects[mid].begin + large_objects[mid].words) lo = mid + 1;
+    else return &large_objects[mid];
+  }
+
+  return NULL;
+}
+
+static void update_large_space_bounds (void) {
+  large_space_low  = large_objects_number ? large_objects[0].begin : NULL;
+  large_space_high = large_objects_number
+    ? large_objects[large_objects_number - 1].begin + large_objects[large_objects_number - 1].words
+    : NULL;
+}
+
+static void* large_alloc (size_t size) {
+  size_t *p = mmap (NULL, size * sizeof(size_t), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  size_t  i;
+
+  if (p == MAP_FAILED) {
+    perror ("EROOR: large_alloc: mmap failed\n");
+    exit   (1);
+  }
+
+  if (large_objects_number == large_objects_capacity) {
+    large_objects_capacity = large_objects_capacity ? 2 * large_objects_capacity : 64;
+    large_objects = realloc (large_objects, large_objects_capacity * sizeof (large_object));
+    if (large_objects == NULL) {
+      perror ("ERROR: large_alloc: realloc failed\n");
+      exit   (1);
     }
-    else {
+  }
+  for (i = large_objects_number; i > 0 && large_objects[i - 1].begin > p; i--)
+    large_objects[i] = large_objects[i - 1];
+  large_objects[i].begin  = p;
+  large_objects[i].words  = size;
+  large_objects[i].object = NULL;
+  large_objects[i].marked = 0;
+  large_objects_number++;
+  update_large_space_bounds ();
+
+  large_words_allocated += size;
+  return p;
+}
+
+/* Marks the large object obj points to, if it is one; returns whether it
+   was not marked before. May be called by several threads at once. */
+static int mark_large_object (size_t *obj) {
+  large_object *l = find_large_object (obj);
+
+  if (l == NULL || __atomic_exchange_n (&l->marked, 1, __ATOMIC_ACQ_REL)) return 0;
+
+  l->object = obj;
+  return 1;
+}
+
+static void push_large_pending (size_t *obj) {
+  if (large_pending_number == large_pending_capacity) {
+    large_pending_capacity = large_pending_capacity ? 2 * large_pending_capacity : 64;
+    large_pending = realloc (large_pending, large_pending_capacity * sizeof (size_t*));
+    if (large_pending == NULL) {
+      perror ("ERROR: push_large_pending: realloc failed\n");
+      exit   (1);
+    }
+  }
+  large_pending[large_pending_number++] = obj;
+}
+
+/* Marks the large object obj points to and has its fields scanned later */
+static void reach_large_object (size_t *obj) {
+  if (mark_large_object (obj)) push_large_pending (obj);
+}
+
+/* Unmaps the objects left unmarked by a major collection and unmarks the
+   others */
+static void sweep_large_objects (void) {
+  size_t i, k = 0;
+
+  for (i = 0; i < large_objects_number; i++) {
+    if (large_objects[i].marked) {
+      large_objects[i].marked = 0;
+      large_objects[k++]      = large_objects[i];
+    }
+    else munmap (large_objects[i].begin, large_objects[i].words * sizeof(size_t));
+  }
+  large_objects_number  = k;
+  large_pending_number  = 0;
+  large_words_allocated = 0;
+  update_large_space_bounds ();
+}
+
+/* Forgets the marks of a major collection given up */
+static void unmark_large_objects (void) {
+  size_t i;
+
+  for (i = 0; i < large_objects_number; i++) large_objects[i].marked = 0;
+  large_pending_number = 0;
+}
+
+/* ======================================== */
+/*           Nursery                        */
+/* ======================================== */
+
+/* Objects are allocated in the nursery, and the survivors are promoted into
+   the old space (from_space) by a minor collection when it fills up; the
+   old space itself is only collected by the major collection, gc. Besides
+   the usual roots, a minor collection scans the old slots young pointers
+   have been stored into since the previous collection (the remembered set),
+   and the old objects that have been written in bulk. The old space always
+   keeps room for a whole nursery, which a major collection copies into
+   to_space along with it. */
+pool nursery;
+
+static int minor_collection = 0;
+
+/* Young pointers may have been stored into the old space without write
+   barriers, so the next collection has to be a major one */
+static int unremembered_stores = 0;
+
+# define IN_NURSERY(p)				\
+  (!UNBOXED(p) &&				\
+   (size_t)nursery.begin   <= (size_t)p &&	\
+   (size_t)nursery.current >  (size_t)p)
+
+/* Open-addressing hash set of old slots */
+static size_t **remembered_slots = NULL;
+static size_t   remembered_slots_number = 0, remembered_slots_capacity = 0;
+
+static size_t **remembered_objects = NULL;
+static size_t   remembered_objects_number = 0, remembered_objects_capacity = 0;
+
+static size_t remembered_slot_index (size_t **slots, size_t capacity, size_t *slot) {
+  size_t i = ((size_t) slot >> 2) * 2654435761u & (capacity - 1);
+
+  while (slots[i] != NULL && slots[i] != slot) i = (i + 1) & (capacity - 1);
+
+  return i;
+}
+
+/* Adds p to the hash set of pointers *set */
+static void pointer_set_add (size_t ***set, size_t *number, size_t *capacity, size_t *p) {
+  size_t i;
+
+  if (2 * (*number + 1) > *capacity) {
+    size_t   new_capacity = *capacity ? 2 * *capacity : 1024;
+    size_t **items        = calloc (new_capacity, sizeof (size_t*));
+
+    if (items == NULL) {
+      perror ("ERROR: pointer_set_add: calloc failed\n");
+      exit   (1);
+    }
+    for (i = 0; i < *capacity; i++) {
+      if ((*set)[i] != NULL)
+        items[remembered_slot_index (items, new_capacity, (*set)[i])] = (*set)[i];
+    }
+    free (*set);
+    *set      = items;
+    *capacity = new_capacity;
+  }
+
+  i = remembered_slot_index (*set, *capacity, p);
+  if ((*set)[i] == NULL) {
+    (*set)[i] = p;
+    (*number)++;
+  }
+}
+
+static void remember_slot (size_t *slot) {
+  pointer_set_add (&remembered_slots, &remembered_slots_number, &remembered_slots_capacity, slot);
+}
+
+static void log_written_object (size_t *obj);
+static void log_written_slot (size_t *obj, void *slot);
+static void stop_replicating (void);
+
+/* Whether slot is a field, or a character, of obj, an object of the old space */
+static int old_field (size_t *obj, void *slot) {
+  data   *d = NULL;
+  size_t  n = 0;
+
+  if (!IN_OLD_SPACE(obj)) return 0;
+
+  d = TO_DATA(obj);
+  n = TAG(d->tag) == STRING_TAG ? LEN(d->tag) : LEN(d->tag) * sizeof (int);
+  return (char*) slot >= (char*) obj && (char*) slot < (char*) obj + n;
+}
+
+extern void gc_write_barrier (void *obj, void *slot, void *v) {
+  if (IN_NURSERY(v) && (IN_OLD_SPACE(slot) || find_large_object (slot) != NULL))
+    remember_slot ((size_t*) slot);
+  /* The replica of an object written into without knowing it can not be
+     kept up to date, so the incremental collection has to start over */
+  if (replicating && IN_OLD_SPACE(slot)) {
+    if (obj == NULL || !old_field ((size_t*) obj, slot)) stop_replicating ();
+    else log_written_slot ((size_t*) obj, slot);
+  }
+}
+
+extern void gc_remember_object (void *obj) {
+  if (UNBOXED(obj) || !(IN_OLD_SPACE(obj) || find_large_object (obj) != NULL)) return;
+
+  if (remembered_objects_number == remembered_objects_capacity) {
+    remembered_objects_capacity = remembered_objects_capacity ? 2 * remembered_objects_capacity : 64;
+    remembered_objects = realloc (remembered_objects, remembered_objects_capacity * sizeof (size_t*));
+    if (remembered_objects == NULL) {
+      perror ("ERROR: gc_remember_object: realloc failed\n");
+      exit   (1);
+    }
+  }
+  remembered_objects[remembered_objects_number++] = (size_t*) obj;
+  if (replicating) log_written_object ((size_t*) obj);
+}
+
+/* Objects of more than NURSERY_OBJECT_SIZE words are allocated straight in
+   the large object space, and the young values their constructors fill them
+   with are found by the next minor collection through this */
+static void remember_new_object (void *obj, size_t bytes) {
+  if (bytes > NURSERY_OBJECT_SIZE * sizeof (size_t)) gc_remember_object (obj);
+}
+
+/* Empties the nursery once its survivors have been copied out */
+static void reset_nursery (void) {
+  nursery.current = nursery.begin;
+  if (remembered_slots_number > 0) {
+    memset (remembered_slots, 0, remembered_slots_capacity * sizeof (size_t*));
+    remembered_slots_number = 0;
+  }
+  remembered_objects_number = 0;
+}
+
+/* ======================================== */
+/*           Incremental collection         */
+/* ======================================== */
+
+/* With LAMA_GC_INCREMENT set, a major collection is done a slice at a time
+   after the minor ones, copying that many words per word allocated since the
+   previous slice. The objects of the old space are replicated into to_space
+   while the program goes on using the originals, whose headers stay intact:
+   the replicas are found through a table, and the slots of the originals
+   written into meanwhile are logged by the write barrier to be copied once
+   more by the next slice; the runtime logs the originals it writes in bulk
+   as a whole. When the replicas are complete, a final pause brings them up
+   to date with the writes since the last slice, redirects the roots to the
+   replicas and flips the spaces. */
+static double GC_INCREMENT = 0;
+
+static size_t *replica_scan, *replica_current;
+
+/* Replicas of the originals: open-addressing hash table */
+static size_t **replica_keys = NULL, **replica_values = NULL;
+static size_t   replicas_number = 0, replicas_capacity = 0;
+
+/* Originals written into in bulk since the previous slice: hash set */
+static size_t **written_objects = NULL;
+static size_t   written_objects_number = 0, written_objects_capacity = 0;
+
+/* Slots of the originals written into since the previous slice, and the
+   objects they are in: open-addressing hash table */
+static size_t **written_slots = NULL, **written_slot_owners = NULL;
+static size_t   written_slots_number = 0, written_slots_capacity = 0;
+
+/* Maps key to value in the open-addressing hash table *keys, *values */
+static void pointer_map_put (size_t ***keys, size_t ***values, size_t *number, size_t *capacity,
+			     size_t *key, size_t *value) {
+  size_t i, k;
+
+  if (2 * (*number + 1) > *capacity) {
+    size_t   new_capacity = *capacity ? 2 * *capacity : 1024;
+    size_t **new_keys     = calloc (new_capacity, sizeof (size_t*));
+    size_t **new_values   = calloc (new_capacity, sizeof (size_t*));
+
+    if (new_keys == NULL || new_values == NULL) {
+      perror ("ERROR: pointer_map_put: calloc failed\n");
+      exit   (1);
+    }
+    for (i = 0; i < *capacity; i++) {
+      if ((*keys)[i] != NULL) {
+        k             = remembered_slot_index (new_keys, new_capacity, (*keys)[i]);
+        new_keys[k]   = (*keys)[i];
+        new_values[k] = (*values)[i];
+      }
+    }
+    free (*keys);
+    free (*values);
+    *keys     = new_keys;
+    *values   = new_values;
+    *capacity = new_capacity;
+  }
+
+  i = remembered_slot_index (*keys, *capacity, key);
+  if ((*keys)[i] == NULL) {
+    (*keys)[i] = key;
+    (*number)++;
+  }
+  (*values)[i] = value;
+}
+
+static void log_written_object (size_t *obj) {
+  pointer_set_add (&written_objects, &written_objects_number, &written_objects_capacity, obj);
+}
+
+static void log_written_slot (size_t *obj, void *slot) {
+  pointer_map_put (&written_slots, &written_slot_owners, &written_slots_number, &written_slots_capacity,
+		   (size_t*) slot, obj);
+}
+
+static size_t* find_replica (size_t *obj) {
+  size_t i;
+
+  if (replicas_number == 0) return NULL;
+
+  i = remembered_slot_index (replica_keys, replicas_capacity, obj);
+  return replica_keys[i] == NULL ? NULL : replica_values[i];
+}
+
+static void add_replica (size_t *obj, size_t *replica) {
+  pointer_map_put (&replica_keys, &replica_values, &replicas_number, &replicas_capacity, obj, replica);
+}
+
+/* Ends the incremental collection, dropping the replicas if it has not
+   flipped the spaces */
+static void stop_replicating (void) {
+  free (replica_keys);
+  free (replica_values);
+  free (written_objects);
+  free (written_slots);
+  free (written_slot_owners);
+  replica_keys   = replica_values = written_objects = NULL;
+  written_slots  = written_slot_owners = NULL;
+  replicas_number        = replicas_capacity        = 0;
+  written_objects_number = written_objects_capacity = 0;
+  written_slots_number   = written_slots_capacity   = 0;
+  replicating = 0;
+  unmark_large_objects ();
+}
+
+/* ======================================== */
+/*           Static space                   */
+/* ======================================== */
+
+/* Objects that live until the end of the run, such as shared string literals.
+   They are never moved nor collected, so they must not point into the heap */
+static pool static_space;
+static size_t STATIC_SPACE_SIZE = 4 * 1024 * 1024;
+
+# define IN_STATIC_SPACE(p)			\
+  (!UNBOXED(p) &&				\
+   (size_t)static_space.begin <= (size_t)p &&	\
+   (size_t)static_space.current > (size_t)p)
+
+/* Returns NULL if the static space is exhausted */
+static void* static_alloc (size_t size) {
+  void *p = NULL;
+  size = (size - 1) / sizeof(size_t) + 1; // convert bytes to words
+  if (static_space.begin == NULL) {
+    static_space.begin = mmap (NULL, STATIC_SPACE_SIZE * sizeof(size_t), PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_NORESERVE, -1, 0);
+    if (static_space.begin == MAP_FAILED) {
+      static_space.begin = NULL;
+      return NULL;
+    }
+    static_space.current = static_space.begin;
+    static_space.end     = static_space.begin + STATIC_SPACE_SIZE;
+    static_space.size    = STATIC_SPACE_SIZE;
+  }
+  if (static_space.current + size > static_space.end) return NULL;
+  p = (void*) static_space.current;
+  static_space.current += size;
+  return p;
+}
+
+/* A string in the static space, to be shared by all evaluations of a literal
+   that is never written to; NULL if the static space is exhausted */
+extern void* Bstring_literal (char *p) {
+  int   n = strlen (p);
+  data *s = (data*) static_alloc (n + 1 + sizeof (int));
+
+  if (s == NULL) return NULL;
+  s->tag = STRING_TAG | (n << 3);
+  strncpy (s->contents, p, n + 1);
+
+  return s->contents;
+}
+
+/* The only instance of a constructor without arguments, which has
+   nothing to write into; NULL if the static space is exhausted */
+extern void* Bsexp_nullary (int tag) {
+  sexp *r = (sexp*) static_alloc (sizeof (int) * 2);
+
+  if (r == NULL) return NULL;
+  r->tag = UNBOX(tag);
+  r->contents.tag = SEXP_TAG;
+
+  return r->contents.contents;
+}
+
+/* Values of the heap and the static space; the collector only ever touches the former */
+int is_valid_heap_pointer (void *p)  {
+  return IS_VALID_HEAP_POINTER(p) || IN_STATIC_SPACE(p) || find_large_object (p) != NULL;
+}
+
+extern size_t * gc_copy (size_t *obj);
+
+/* Cheney scan: gc_copy copies an object without following its fields,
+   which gc_scan then fixes up going through the copies in order, behind
+   current. Until then the hash word of a copied sexp has its lowest bits
+   set to 10, which tells it from the headers of other objects, all odd. */
+# define SCAN_SEXP_MARK(h) ((((size_t) (h)) << 2) | 2)
+# define SCAN_SEXP_HASH(w) (((size_t) (w)) >> 2)
+
+static void copy_elements (size_t *where, int len) {
+  int i = 0;
+
+  for (i = 0; i < len; i++) {
+    size_t elem = where[i];
+
+    if (i + 1 < len && IS_COLLECTED(where[i + 1])) __builtin_prefetch (TO_DATA(where[i + 1]));
+    if (IS_COLLECTED(elem)) where[i] = (size_t) gc_copy ((size_t*) elem);
+    else if (!minor_collection) reach_large_object ((size_t*) elem);
+  }
+}
+
+/* Fixes up the fields of the objects copied from scan on */
+static void gc_scan (size_t *scan) {
+  while (scan < current) {
+    size_t w = *scan;
+    int    n = 0;
+
+    if (!UNBOXED(w)) {
+      n     = LEN(scan[1]);
+      *scan = SCAN_SEXP_HASH(w);
+      copy_elements (scan + 2, n);
+      scan += n + 2;
+      continue;
+    }
+
+    n = LEN(w);
+    switch (TAG(w)) {
+    case STRING_TAG:
+      scan += (n + sizeof(int)) / sizeof(size_t) + 1;
+      break;
+
+    case ARRAY_TAG:
+    case CLOSURE_TAG:
+      copy_elements (scan + 1, n);
+      scan += ((n + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+      break;
+
+    default:
+      perror ("ERROR: gc_scan: weird tag");
+      exit (1);
+    }
+  }
+}
+
+/* gc_scan along with the fields of the large objects reached */
+static void gc_scan_all (size_t *scan) {
+  for (;;) {
+    gc_scan (scan);
+    scan = current;
+    if (large_pending_number == 0) return;
+
+    while (large_pending_number > 0) {
+      size_t *obj = large_pending[--large_pending_number];
+
+      if (TAG(TO_DATA(obj)->tag) != STRING_TAG) copy_elements (obj, LEN(TO_DATA(obj)->tag));
+    }
+  }
+}
+
+static int extend_spaces (void) {
+  void *p = (void *) BOX (NULL);
+  size_t words          = limited_space_size ((to_space.end - to_space.begin) << 1, 0),
+         old_space_size = to_space.size * sizeof(size_t),
+         new_space_size = words         * sizeof(size_t);
+  if (words > to_space.size) p = mremap(to_space.begin, old_space_size, new_space_size, 0);
 #ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("copy_elements: fix element: %p -> %p\n", elem, *where);
-      fflush (stdout);
+  indent++; print_indent ();
 #endif
-      p = gc_copy ((size_t*) elem);
-      *where = (size_t) p;
-      where ++;
-    }
+  if (p == MAP_FAILED) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("extend: extend_spaces: mremap failed\n"); fflush (stdout);
+#endif
+    return 1;
+  }
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("extend: %p %p %p %p\n", p, to_space.begin, to_space.end, current);
+  fflush (stdout);
+  indent--;
+#endif
+  to_space.end    =  to_space.begin + words;
+  if (words > to_space.size) to_space.size = words;
+  SPACE_SIZE      =  words;
+  return 0;
+}
+
+extern size_t * gc_copy (size_t *obj) {
+  data   *d    = TO_DATA(obj);
+  size_t *copy = current;
+  int     n    = 0;
+#ifdef DEBUG_PRINT
+  indent++; print_indent ();
+  printf ("gc_copy: %p cur = %p starts\n", obj, current);
+  fflush (stdout);
+#endif
+
+  if (!IS_COLLECTED(obj)) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("gc_copy: invalid ptr: %p\n", obj); fflush (stdout);
+    indent--;
+#endif
+    return obj;
+  }
+
+  if (!minor_collection && !IN_PASSIVE_SPACE(current) && current != to_space.end) {
+    perror("ERROR: gc_copy: out-of-space\n");
+    exit (1);
+  }
+
+  if (IS_FORWARD_PTR(d->tag)) {
+#ifdef DEBUG_PRINT
+    print_indent ();
+    printf ("gc_copy: IS_FORWARD_PTR: return! %p -> %p\n", obj, (size_t *) d->tag);
+    fflush(stdout);
+    indent--;
+#endif
+    return (size_t *) d->tag;
+  }
+
+  n = LEN(d->tag);
+  switch (TAG(d->tag)) {
+    case CLOSURE_TAG:
+    case ARRAY_TAG:
+      current += ((n + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+      memcpy (copy, d, (n + 1) * sizeof (int));
+      copy++;
+      break;
+
+    case STRING_TAG:
+      current += (n + sizeof(int)) / sizeof(size_t) + 1;
+      memcpy (copy, d, sizeof (int) + n + 1);
+      copy++;
+      break;
+
+  case SEXP_TAG  :
+      current += n + 2;
+      *copy = SCAN_SEXP_MARK(TO_SEXP(obj)->tag);
+      copy++;
+      memcpy (copy, d, (n + 1) * sizeof (int));
+      copy++;
+      break;
+
+  default:
 #ifdef DEBUG_PRINT
     print_indent ();
-    printf ("copy_elements: iteration end: where = %p, *where = %p, i = %d, \
-             len = %d\n", where, *where, i, len); fflush (stdout);
+    printf ("ERROR: gc_copy: weird tag: %p", TAG(d->tag)); fflush (stdout);
+    indent--;
 #endif
+    perror ("ERROR: gc_copy: weird tag");
+    exit (1);
+    return (obj);
+  }
+  d->tag = (int) copy;
+#ifdef DEBUG_PRINT
+  print_indent ();
+  printf ("gc_copy: %p -> %p; new-current = %p\n", obj, copy, current);
+  fflush (stdout);
+  indent--;
+#endif
+  return copy;
+}
+
+/* ======================================== */
+/*           Parallel collection            */
+/* ======================================== */
+
+/* With LAMA_GC_THREADS set above 1, the major collections of a big enough
+   heap copy with that many threads. The roots are gathered first and then
+   shared out in chunks. Each thread copies into buffers of its own claimed
+   from to_space, and an object goes to the thread which replaces its header
+   with the forwarding pointer by a compare-and-swap. A copy whose fields are
+   still to be fixed up waits in the deque of its thread, from the other end
+   of which the idle threads steal. to_space is not walked, so the copies of
+   sexps keep their hash words as is and the buffer tails stay unused. */
+# define MAX_GC_THREADS       64
+# define GC_BUFFER_WORDS      (16 * 1024)
+# define GC_ROOTS_CHUNK       256
+# define PARALLEL_GC_MIN_HEAP (1024 * 1024) /* words */
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t        **items;    /* items[top .. bottom) are waiting */
+  size_t          top;
+  size_t          bottom;
+  size_t          capacity;
+} gc_deque;
+
+typedef struct {
+  size_t  *buffer;
+  size_t  *buffer_end;
+  gc_deque deque;
+} gc_worker;
+
+static int        gc_threads = 1;
+static gc_worker *gc_workers;
+static int        gc_idle_workers;
+
+/* The roots gathered instead of copied by gc_test_and_copy_root */
+static int        gathering_roots = 0;
+static size_t  ***gathered_roots;
+static size_t     gathered_roots_number;
+static size_t     gathered_roots_capacity;
+static size_t     next_roots_chunk;
+
+static void init_gc_threads (void) {
+  char *e = getenv ("LAMA_GC_THREADS"), *end = NULL;
+
+  if (e == NULL || *e == 0) return;
+
+  gc_threads = strtol (e, &end, 10);
+  if (*end != 0 || gc_threads < 1 || gc_threads > MAX_GC_THREADS)
+    failure ("LAMA_GC_THREADS: number from 1 to %d expected, got %s\n", MAX_GC_THREADS, e);
+}
+
+static void init_gc_increment (void) {
+  char *e = getenv ("LAMA_GC_INCREMENT"), *end = NULL;
+
+  if (e == NULL || *e == 0) return;
+
+  GC_INCREMENT = strtod (e, &end);
+  if (*end != 0 || !(GC_INCREMENT > 0))
+    failure ("LAMA_GC_INCREMENT: positive number of words expected, got %s\n", e);
+}
+
+/* Words of to_space a parallel copy of used words may take, with the buffer
+   tails thrown in; 0 if the copies are serial */
+static size_t parallel_gc_room (size_t used) {
+  if (gc_threads == 1) return 0;
+
+  return used + used / 2 + 2 * gc_threads * GC_BUFFER_WORDS;
+}
+
+/* Whether the coming major collection is worth and safe to do in parallel:
+   the mapping of to_space, which init_to_space makes big enough unless the
+   heap limit is in the way, must hold the whole heap with the buffer tails */
+static int parallel_gc_enabled (void) {
+  size_t used = (from_space.current - from_space.begin) + (nursery.current - nursery.begin);
+
+  return gc_threads > 1
+    && used >= PARALLEL_GC_MIN_HEAP
+    && to_space.size >= parallel_gc_room (used);
+}
+
+static void gather_root (size_t ** root) {
+  if (gathered_roots_number == gathered_roots_capacity) {
+    gathered_roots_capacity = gathered_roots_capacity ? 2 * gathered_roots_capacity : 1024;
+    gathered_roots = realloc (gathered_roots, gathered_roots_capacity * sizeof(size_t**));
+    if (gathered_roots == NULL) {
+      perror ("ERROR: gather_root: realloc failed\n");
+      exit   (1);
+    }
+  }
+  gathered_roots[gathered_roots_number++] = root;
+}
+
+static void deque_push (gc_deque *q, size_t *obj) {
+  pthread_mutex_lock (&q->lock);
+  if (q->bottom == q->capacity) {
+    if (q->top > 0) {
+      memmove (q->items, q->items + q->top, (q->bottom - q->top) * sizeof(size_t*));
+      q->bottom -= q->top;
+      q->top     = 0;
+    }
+    else {
+      q->capacity = q->capacity ? 2 * q->capacity : 1024;
+      q->items    = realloc (q->items, q->capacity * sizeof(size_t*));
+      if (q->items == NULL) {
+	perror ("ERROR: deque_push: realloc failed\n");
+	exit   (1);
+      }
+    }
+  }
+  q->items[q->bottom++] = obj;
+  pthread_mutex_unlock (&q->lock);
+}
+
+/* Takes the newest object from the owner's end, or the oldest one from the
+   other end for a thief; NULL if the deque is empty */
+static size_t* deque_take (gc_deque *q, int steal) {
+  size_t *obj = NULL;
+
+  pthread_mutex_lock (&q->lock);
+  if (q->top < q->bottom) obj = steal ? q->items[q->top++] : q->items[--q->bottom];
+  if (q->top == q->bottom) q->top = q->bottom = 0;
+  pthread_mutex_unlock (&q->lock);
+
+  return obj;
+}
+
+/* Claims words of to_space for all threads */
+static size_t* claim_to_space (size_t words) {
+  size_t *p = __atomic_fetch_add (&current, words * sizeof(size_t), __ATOMIC_RELAXED);
+
+  if (p + words > to_space.end) {
+    perror ("ERROR: claim_to_space: out-of-space\n");
+    exit   (1);
+  }
+  return p;
+}
+
+static size_t* worker_alloc (gc_worker *w, size_t words) {
+  size_t *p = NULL;
+
+  if (words > GC_BUFFER_WORDS / 4) return claim_to_space (words);
+
+  if (w->buffer + words > w->buffer_end) {
+    w->buffer     = claim_to_space (GC_BUFFER_WORDS);
+    w->buffer_end = w->buffer + GC_BUFFER_WORDS;
+  }
+  p          = w->buffer;
+  w->buffer += words;
+  return p;
+}
+
+static size_t* parallel_copy (gc_worker *w, size_t *obj) {
+  data   *d = TO_DATA(obj);
+  size_t  h = __atomic_load_n ((size_t*) &d->tag, __ATOMIC_ACQUIRE);
+  size_t *copy = NULL, *res = NULL, words = 0;
+  int     n = 0;
+
+  /* Headers are odd, forwarding pointers are not */
+  if (!UNBOXED(h)) return (size_t*) h;
+
+  n = LEN(h);
+  switch (TAG(h)) {
+  case CLOSURE_TAG:
+  case ARRAY_TAG:
+    words = ((n + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+    copy  = worker_alloc (w, words);
+    memcpy (copy, d, (n + 1) * sizeof (int));
+    res = copy + 1;
+    break;
+
+  case STRING_TAG:
+    words = (n + sizeof(int)) / sizeof(size_t) + 1;
+    copy  = worker_alloc (w, words);
+    memcpy (copy, d, sizeof (int) + n + 1);
+    res = copy + 1;
+    break;
+
+  case SEXP_TAG:
+    words   = n + 2;
+    copy    = worker_alloc (w, words);
+    copy[0] = TO_SEXP(obj)->tag;
+    memcpy (copy + 1, d, (n + 1) * sizeof (int));
+    res = copy + 2;
+    break;
+
+  default:
+    perror ("ERROR: parallel_copy: weird tag");
+    exit (1);
+  }
+  /* The header may have been forwarded while being copied */
+  res[-1] = h;
+
+  if (!__atomic_compare_exchange_n ((size_t*) &d->tag, &h, (size_t) res, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    /* Another thread has copied it; give the words back if still possible */
+    if (copy + words == w->buffer) w->buffer = copy;
+    return (size_t*) h;
+  }
+
+  if (TAG(res[-1]) != STRING_TAG && n > 0) deque_push (&w->deque, res);
+  return res;
+}
+
+static void parallel_scan (gc_worker *w, size_t *obj) {
+  int i, n = LEN(TO_DATA(obj)->tag);
+
+  for (i = 0; i < n; i++) {
+    if (IS_COLLECTED(obj[i])) obj[i] = (size_t) parallel_copy (w, (size_t*) obj[i]);
+    else if (mark_large_object ((size_t*) obj[i]) && TAG(TO_DATA(obj[i])->tag) != STRING_TAG)
+      deque_push (&w->deque, (size_t*) obj[i]);
+  }
+}
+
+static size_t* steal_work (gc_worker *w) {
+  size_t *obj = NULL;
+  int     i, k = w - gc_workers;
+
+  for (i = 1; i < gc_threads && obj == NULL; i++)
+    obj = deque_take (&gc_workers[(k + i) % gc_threads].deque, 1);
+
+  return obj;
+}
+
+static int work_left (void) {
+  int i;
+
+  for (i = 0; i < gc_threads; i++)
+    if (__atomic_load_n (&gc_workers[i].deque.bottom, __ATOMIC_ACQUIRE) != 0) return 1;
+
+  return 0;
+}
+
+static void* gc_worker_run (void *arg) {
+  gc_worker *w   = (gc_worker*) arg;
+  size_t    *obj = NULL;
+  size_t     i, k, last;
+
+  for (;;) {
+    i = __atomic_fetch_add (&next_roots_chunk, GC_ROOTS_CHUNK, __ATOMIC_RELAXED);
+    if (i >= gathered_roots_number) break;
+    last = i + GC_ROOTS_CHUNK < gathered_roots_number ? i + GC_ROOTS_CHUNK : gathered_roots_number;
+    /* A root may be gathered twice and be updated already */
+    for (k = i; k < last; k++)
+      if (IS_COLLECTED(*gathered_roots[k]))
+	*gathered_roots[k] = parallel_copy (w, *gathered_roots[k]);
+  }
+
+  /* Only the owner pushes to a deque, so once all the threads are idle
+     with their deques empty no work can appear */
+  for (;;) {
+    while ((obj = deque_take (&w->deque, 0)) != NULL) parallel_scan (w, obj);
+    if ((obj = steal_work (w)) != NULL) {
+      parallel_scan (w, obj);
+      continue;
+    }
+    __atomic_add_fetch (&gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n (&gc_idle_workers, __ATOMIC_SEQ_CST) == gc_threads) return NULL;
+      if (work_left ()) break;
+      sched_yield ();
+    }
+    __atomic_sub_fetch (&gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/* Copies everything reachable from the gathered roots into to_space from
+   current on, leaving current past the last claimed buffer */
+static void parallel_collect (void) {
+  pthread_t threads[MAX_GC_THREADS];
+  int       i;
+
+  gc_workers = calloc (gc_threads, sizeof(gc_worker));
+  if (gc_workers == NULL) {
+    perror ("ERROR: parallel_collect: calloc failed\n");
+    exit   (1);
+  }
+  for (i = 0; i < gc_threads; i++) pthread_mutex_init (&gc_workers[i].deque.lock, NULL);
+  gc_idle_workers  = 0;
+  next_roots_chunk = 0;
+  /* The large objects the roots point to */
+  while (large_pending_number > 0) {
+    size_t *obj = large_pending[--large_pending_number];
+
+    if (TAG(TO_DATA(obj)->tag) != STRING_TAG) deque_push (&gc_workers[0].deque, obj);
+  }
+
+  for (i = 1; i < gc_threads; i++)
+    if (pthread_create (&threads[i], NULL, gc_worker_run, &gc_workers[i])) {
+      perror ("ERROR: parallel_collect: pthread_create failed\n");
+      exit   (1);
+    }
+  gc_worker_run (&gc_workers[0]);
+  for (i = 1; i < gc_threads; i++) pthread_join (threads[i], NULL);
+
+  for (i = 0; i < gc_threads; i++) {
+    pthread_mutex_destroy (&gc_workers[i].deque.lock);
+    free (gc_workers[i].deque.items);
+  }
+  free (gc_workers);
+  gc_workers            = NULL;
+  gathered_roots_number = 0;
+}
+
+/* Replicates an original of the old space, leaving the fields of the
+   replica to scan_replicas */
+static size_t* replicate (size_t *obj) {
+  data   *d    = TO_DATA(obj);
+  size_t *copy = find_replica (obj);
+  int     n    = LEN(d->tag);
+
+  if (copy != NULL) return copy;
+
+  copy = replica_current;
+  switch (TAG(d->tag)) {
+  case CLOSURE_TAG:
+  case ARRAY_TAG:
+    replica_current += ((n + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+    memcpy (copy, d, (n + 1) * sizeof (int));
+    copy++;
+    break;
+
+  case STRING_TAG:
+    replica_current += (n + sizeof(int)) / sizeof(size_t) + 1;
+    memcpy (copy, d, sizeof (int) + n + 1);
+    copy++;
+    break;
+
+  case SEXP_TAG:
+    replica_current += n + 2;
+    *copy = SCAN_SEXP_MARK(TO_SEXP(obj)->tag);
+    memcpy (copy + 1, d, (n + 1) * sizeof (int));
+    copy += 2;
+    break;
+
+  default:
+    perror ("ERROR: replicate: weird tag");
+    exit (1);
+  }
+  add_replica (obj, copy);
+  return copy;
+}
+
+/* The nursery is empty whenever replicas are made, so all the heap pointers
+   of the originals are old */
+static void replicate_elements (size_t *where, int len) {
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (IS_VALID_HEAP_POINTER(where[i])) where[i] = (size_t) replicate ((size_t*) where[i]);
+    else reach_large_object ((size_t*) where[i]);
+  }
+}
+
+/* The large objects are shared with the program, so their fields are only
+   redirected to the replicas when the spaces flip */
+static int redirect_large = 0;
+
+static void replicate_large_pending (void) {
+  while (large_pending_number > 0) {
+    size_t *obj = large_pending[--large_pending_number];
+    int     i, n = LEN(TO_DATA(obj)->tag);
+
+    if (TAG(TO_DATA(obj)->tag) == STRING_TAG) continue;
+
+    for (i = 0; i < n; i++) {
+      if (IS_VALID_HEAP_POINTER(obj[i])) {
+        size_t *copy = replicate ((size_t*) obj[i]);
+        if (redirect_large) obj[i] = (size_t) copy;
+      }
+      else reach_large_object ((size_t*) obj[i]);
+    }
+  }
+}
+
+/* Fixes up the fields of the replicas in order, budget words of them or
+   all if it is 0; returns whether all are done */
+static int scan_replicas (size_t budget) {
+  size_t *scan = replica_scan;
+
+  while (budget == 0 || replica_scan < scan + budget) {
+    size_t w = 0;
+    int    n = 0;
+
+    if (replica_scan == replica_current) {
+      if (large_pending_number == 0) break;
+      replicate_large_pending ();
+      continue;
+    }
+
+    w = *replica_scan;
+
+    if (!UNBOXED(w)) {
+      n             = LEN(replica_scan[1]);
+      *replica_scan = SCAN_SEXP_HASH(w);
+      replicate_elements (replica_scan + 2, n);
+      replica_scan += n + 2;
+      continue;
+    }
+
+    n = LEN(w);
+    switch (TAG(w)) {
+    case STRING_TAG:
+      replica_scan += (n + sizeof(int)) / sizeof(size_t) + 1;
+      break;
+
+    case ARRAY_TAG:
+    case CLOSURE_TAG:
+      replicate_elements (replica_scan + 1, n);
+      replica_scan += ((n + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+      break;
+
+    default:
+      perror ("ERROR: scan_replicas: weird tag");
+      exit (1);
+    }
+  }
+
+  return replica_scan == replica_current && large_pending_number == 0;
+}
+
+/* Copies the logged writes into the replicas and empties the logs; the
+   originals without replicas yet are copied as they are when replicated.
+   The nursery must be empty. */
+static void update_replicas (void) {
+  size_t *obj, *copy, i;
+  char   *slot;
+  int     n;
+
+  for (i = 0; i < written_slots_capacity; i++) {
+    slot = (char*) written_slots[i];
+    obj  = written_slot_owners[i];
+    if (slot == NULL || (copy = find_replica (obj)) == NULL) continue;
+    if (TAG(TO_DATA(obj)->tag) == STRING_TAG) ((char*) copy)[slot - (char*) obj] = *slot;
+    else {
+      copy += (size_t*) slot - obj;
+      *copy = *(size_t*) slot;
+      replicate_elements (copy, 1);
+    }
+  }
+  if (written_slots_number > 0) {
+    memset (written_slots, 0, written_slots_capacity * sizeof (size_t*));
+    written_slots_number = 0;
+  }
+
+  for (i = 0; i < written_objects_capacity; i++) {
+    obj = written_objects[i];
+    if (obj == NULL || (copy = find_replica (obj)) == NULL) continue;
+    n = LEN(TO_DATA(obj)->tag);
+    if (TAG(TO_DATA(obj)->tag) == STRING_TAG) memcpy (copy, obj, n + 1);
+    else {
+      memcpy (copy, obj, n * sizeof (int));
+      replicate_elements (copy, n);
+    }
+  }
+  if (written_objects_number > 0) {
+    memset (written_objects, 0, written_objects_capacity * sizeof (size_t*));
+    written_objects_number = 0;
+  }
+}
+
+/* ======================================== */
+/*           Mark-compact collection        */
+/* ======================================== */
+
+/* With LAMA_GC=compact, a major collection slides the live objects of the
+   old space down in place and appends the survivors of the nursery to them,
+   so that to_space is never needed. Marking sets a bit for the header of
+   each live object and bits for all of its words; the new address of a word
+   is then the number of live words before it, counted by blocks of
+   BLOCK_WORDS words. The headers stay in place until the objects are moved,
+   after all of the pointers to them have been updated. */
+static int mark_compact = 0;
+
+# define BLOCK_WORDS (sizeof(size_t) * CHAR_BIT)
+# define BIT(i)      ((size_t) 1 << ((i) % BLOCK_WORDS))
+
+typedef struct {
+  size_t  *begin;
+  size_t  *end;
+  size_t  *headers; /* bit per word: the header of a live object */
+  size_t  *live;    /* bit per word: a word of a live object */
+  size_t **base;    /* per block: new address of its first live word */
+} compact_region;
+
+/* The old space and the nursery */
+static compact_region compact_regions[2];
+
+static size_t **mark_stack = NULL;
+static size_t   mark_stack_size = 0, mark_stack_capacity = 0;
+
+/* How gc_test_and_copy_root treats the roots during a mark-compact
+   collection */
+# define MARK_ROOTS   1
+# define UPDATE_ROOTS 2
 
-  }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("\tcopy_elements: end\n"); fflush (stdout);
-  indent--;
-#endif
+static int compact_roots = 0;
+
+static void init_mark_compact (void) {
+  char *e = getenv ("LAMA_GC");
 
+  if (e == NULL || *e == 0 || strcmp (e, "copy") == 0) return;
+  if (strcmp (e, "compact") != 0) failure ("LAMA_GC: copy or compact expected, got %s\n", e);
+
+  mark_compact = 1;
 }
 
-static int extend_spaces (void) {
-  void *p = (void *) BOX (NULL);
-  size_t old_space_size = SPACE_SIZE        * sizeof(size_t),
-         new_space_size = (SPACE_SIZE << 1) * sizeof(size_t);
-  p = mremap(to_space.begin, old_space_size, new_space_size, 0);
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-#endif
-  if (p == MAP_FAILED) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("extend: extend_spaces: mremap failed\n"); fflush (stdout);
-#endif
-    return 1;
+static compact_region* compact_region_of (size_t *p) {
+  int i;
+
+  if (UNBOXED(p)) return NULL;
+
+  for (i = 0; i < 2; i++)
+    if (compact_regions[i].begin <= p && p < compact_regions[i].end) return &compact_regions[i];
+
+  return NULL;
+}
+
+/* The number of words of the object obj, the hash word of a sexp included */
+static size_t object_words (size_t *obj) {
+  data *d = TO_DATA(obj);
+  int   n = LEN(d->tag);
+
+  switch (TAG(d->tag)) {
+  case STRING_TAG:
+    return (n + sizeof(int)) / sizeof(size_t) + 1;
+
+  case ARRAY_TAG:
+  case CLOSURE_TAG:
+    return ((n + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+
+  case SEXP_TAG:
+    return n + 2;
+
+  default:
+    perror ("ERROR: object_words: weird tag");
+    exit (1);
   }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("extend: %p %p %p %p\n", p, to_space.begin, to_space.end, current);
-  fflush (stdout);
-  indent--;
-#endif
-  to_space.end    += SPACE_SIZE;
-  SPACE_SIZE      =  SPACE_SIZE << 1;
-  to_space.size   =  SPACE_SIZE;
-  return 0;
 }
 
-extern size_t * gc_copy (size_t *obj) {
-  data   *d    = TO_DATA(obj);
-  sexp   *s    = NULL;
-  size_t *copy = NULL;
-  int     i    = 0;
-#ifdef DEBUG_PRINT
-  int len1, len2, len3;
-  void * objj;
-  void * newobjj = (void*)current;
-  indent++; print_indent ();
-  printf ("gc_copy: %p cur = %p starts\n", obj, current);
-  fflush (stdout);
-#endif
+static void set_bits (size_t *map, size_t from, size_t to) {
+  for (; from < to && from % BLOCK_WORDS != 0; from++) map[from / BLOCK_WORDS] |= BIT(from);
+  for (; from + BLOCK_WORDS <= to; from += BLOCK_WORDS) map[from / BLOCK_WORDS] = ~(size_t) 0;
+  for (; from < to; from++) map[from / BLOCK_WORDS] |= BIT(from);
+}
 
-  if (!IS_VALID_HEAP_POINTER(obj)) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("gc_copy: invalid ptr: %p\n", obj); fflush (stdout);
-    indent--;
-#endif
-    return obj;
+static void mark_object (size_t *obj) {
+  compact_region *r = compact_region_of (obj);
+  size_t          i, first;
+
+  if (r == NULL) {
+    if (!mark_large_object (obj)) return;
   }
+  else {
+    i = (size_t*) TO_DATA(obj) - r->begin;
+    if (r->headers[i / BLOCK_WORDS] & BIT(i)) return;
 
-  if (!IN_PASSIVE_SPACE(current) && current != to_space.end) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf("ERROR: gc_copy: out-of-space %p %p %p\n",
-	   current, to_space.begin, to_space.end);
-    fflush(stdout);
-#endif
-    perror("ERROR: gc_copy: out-of-space\n");
-    exit (1);
+    r->headers[i / BLOCK_WORDS] |= BIT(i);
+    first = TAG(TO_DATA(obj)->tag) == SEXP_TAG ? i - 1 : i;
+    set_bits (r->live, first, first + object_words (obj));
   }
 
-  if (IS_FORWARD_PTR(d->tag)) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("gc_copy: IS_FORWARD_PTR: return! %p -> %p\n", obj, (size_t *) d->tag);
-    fflush(stdout);
-    indent--;
-#endif
-    return (size_t *) d->tag;
+  if (TAG(TO_DATA(obj)->tag) == STRING_TAG) return;
+
+  if (mark_stack_size == mark_stack_capacity) {
+    mark_stack_capacity = mark_stack_capacity ? 2 * mark_stack_capacity : 1024;
+    mark_stack = realloc (mark_stack, mark_stack_capacity * sizeof (size_t*));
+    if (mark_stack == NULL) {
+      perror ("ERROR: mark_object: realloc failed\n");
+      exit   (1);
+    }
   }
+  mark_stack[mark_stack_size++] = obj;
+}
 
-  copy = current;
-#ifdef DEBUG_PRINT
-  objj = d;
-#endif
-  switch (TAG(d->tag)) {
-    case CLOSURE_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("gc_copy:closure_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
-#endif
-      i = LEN(d->tag);
-      // current += LEN(d->tag) + 1;
-      // current += ((LEN(d->tag) + 1) * sizeof(int) -1) / sizeof(size_t) + 1;
-      current += i+1;
-      *copy = d->tag;
-      copy++;
-      d->tag = (int) copy;
-      copy_elements (copy, obj, i);
-      break;
+static void mark_reachable (void) {
+  while (mark_stack_size > 0) {
+    size_t *obj = mark_stack[--mark_stack_size];
+    int     i, n = LEN(TO_DATA(obj)->tag);
 
-    case ARRAY_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("gc_copy:array_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
-#endif
-      current += ((LEN(d->tag) + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
-      *copy = d->tag;
-      copy++;
-      i = LEN(d->tag);
-      d->tag = (int) copy;
-      copy_elements (copy, obj, i);
-      break;
+    for (i = 0; i < n; i++) mark_object ((size_t*) obj[i]);
+  }
+}
 
-    case STRING_TAG:
-#ifdef DEBUG_PRINT
-      print_indent ();
-      printf ("gc_copy:string_tag; len = %d\n", LEN(d->tag) + 1); fflush (stdout);
-#endif
-      current += (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
-      *copy = d->tag;
-      copy++;
-      d->tag = (int) copy;
-      strcpy ((char*)&copy[0], (char*) obj);
-      break;
+/* Assigns the live words of r their new addresses from dest on; returns
+   the address past them */
+static size_t* compute_bases (compact_region *r, size_t *dest) {
+  size_t b, blocks = (r->end - r->begin + BLOCK_WORDS - 1) / BLOCK_WORDS;
 
-  case SEXP_TAG  :
-      s = TO_SEXP(obj);
-#ifdef DEBUG_PRINT
-      objj = s;
-      len1 = LEN(s->contents.tag);
-      len2 = LEN(s->tag);
-      len3 = LEN(d->tag);
-      print_indent ();
-      printf ("gc_copy:sexp_tag; len1 = %li, len2=%li, len3 = %li\n",
-	      len1, len2, len3);
-      fflush (stdout);
-#endif
-      i = LEN(s->contents.tag);
-      current += i + 2;
-      *copy = s->tag;
-      copy++;
-      *copy = d->tag;
-      copy++;
-      d->tag = (int) copy;
-      copy_elements (copy, obj, i);
-      break;
+  for (b = 0; b < blocks; b++) {
+    r->base[b] = dest;
+    dest      += __builtin_popcountl (r->live[b]);
+  }
 
-  default:
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("ERROR: gc_copy: weird tag: %p", TAG(d->tag)); fflush (stdout);
-    indent--;
-#endif
-    perror ("ERROR: gc_copy: weird tag");
-    exit (1);
-    return (obj);
+  return dest;
+}
+
+static size_t* compact_forward (size_t *obj) {
+  compact_region *r = compact_region_of (obj);
+  size_t          i;
+
+  if (r == NULL) return obj;
+
+  i = (size_t*) TO_DATA(obj) - r->begin;
+  return r->base[i / BLOCK_WORDS] + __builtin_popcountl (r->live[i / BLOCK_WORDS] & (BIT(i) - 1)) + 1;
+}
+
+/* Calls f on each live object of r in address order */
+static void for_each_live (compact_region *r, void (*f) (size_t *obj)) {
+  size_t b, blocks = (r->end - r->begin + BLOCK_WORDS - 1) / BLOCK_WORDS;
+
+  for (b = 0; b < blocks; b++) {
+    size_t bits = r->headers[b];
+
+    while (bits != 0) {
+      size_t i = b * BLOCK_WORDS + __builtin_ctzl (bits);
+
+      bits &= bits - 1;
+      f (r->begin + i + 1);
+    }
   }
-#ifdef DEBUG_PRINT
-  print_indent ();
-  printf ("gc_copy: %p(%p) -> %p (%p); new-current = %p\n",
-	  obj, objj, copy, newobjj, current);
-  fflush (stdout);
-  indent--;
-#endif
-  return copy;
 }
 
+static void update_fields (size_t *obj) {
+  int i, n = LEN(TO_DATA(obj)->tag);
+
+  if (TAG(TO_DATA(obj)->tag) == STRING_TAG) return;
+
+  for (i = 0; i < n; i++) obj[i] = (size_t) compact_forward ((size_t*) obj[i]);
+}
+
+/* Objects only move down within a region, over the ones moved before */
+static void move_object (size_t *obj) {
+  size_t first = TAG(TO_DATA(obj)->tag) == SEXP_TAG ? 2 : 1;
+
+  if (IN_OLD_SPACE(obj) && compact_forward (obj) != obj) gc_counts[MOVED_OBJECTS]++;
+  memmove (compact_forward (obj) - first, obj - first, object_words (obj) * sizeof (size_t));
+}
+
+/* How gc_test_and_copy_root treats the roots during an incremental
+   collection */
+# define REPLICATE_ROOTS 1
+# define REDIRECT_ROOTS  2
+
+static int root_replication = 0;
+
 extern void gc_test_and_copy_root (size_t ** root) {
+  if (compact_roots) {
+    if (compact_roots == MARK_ROOTS) mark_object (*root);
+    else *root = compact_forward (*root);
+    return;
+  }
+  if (root_replication) {
+    if (IS_VALID_HEAP_POINTER(*root)) {
+      size_t *copy = replicate (*root);
+      if (root_replication == REDIRECT_ROOTS) *root = copy;
+    }
+    else reach_large_object (*root);
+    return;
+  }
+  if (gathering_roots) {
+    if (IS_COLLECTED(*root)) gather_root (root);
+    else reach_large_object (*root);
+    return;
+  }
+  if (!minor_collection && !IS_COLLECTED(*root)) reach_large_object (*root);
 #ifdef DEBUG_PRINT
     indent++;
 #endif
-  if (IS_VALID_HEAP_POINTER(*root)) {
+  if (IS_COLLECTED(*root)) {
 #ifdef DEBUG_PRINT
     print_indent ();
     printf ("gc_test_and_copy_root: root %p top=%p bot=%p  *root %p \n", root, __gc_stack_top, __gc_stack_bottom, *root);
@@ -1900,6 +3636,7 @@ extern void* Bclosure_my (int bn, void *entry, int *values) {
     r = (data*) alloc (sizeof(int) * (n+2));
 
     r->tag = CLOSURE_TAG | ((n + 1) << 3);
+    remember_new_object (r->contents, sizeof(int) * (n+2));
     ((void**) r->contents)[0] = entry;
 
     for (i = 0; i<n; i++) {
@@ -1937,6 +3674,7 @@ extern void* Barray_my (int bn, int *data_) {
     r = (data*) alloc (sizeof(int) * (n+1));
 
     r->tag = ARRAY_TAG | (n << 3);
+    remember_new_object (r->contents, sizeof(int) * (n+1));
 
     for (i = 0; i<n; i++) {
         ai = *(data_++);
@@ -1967,6 +3705,7 @@ extern void* Bsexp_my (int bn, int tag, int *data_) {
     r->tag = 0;
 
     d->tag = SEXP_TAG | ((n-1) << 3);
+    remember_new_object (d->contents, sizeof(int) * (n+1));
 
     for (i=0; i<n-1; i++) {
         ai = *(data_++);
@@ -2006,10 +3745,17 @@ extern void* Belem_link (void *p, int i) {
 }
 
 extern void __init (void) {
-  size_t space_size = SPACE_SIZE * sizeof(size_t);
+  size_t space_size = 0;
 
   srandom (time (NULL));
 
+  init_heap_sizing ();
+  init_gc_threads ();
+  init_gc_increment ();
+  init_mark_compact ();
+  init_gc_stats ();
+  space_size = SPACE_SIZE * sizeof(size_t);
+
   from_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
     			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
   to_space.begin   = NULL;
@@ -2023,14 +3769,60 @@ extern void __init (void) {
   to_space.current   = NULL;
   to_space.end       = NULL;
   to_space.size      = 0;
+  nursery.begin = mmap (NULL, NURSERY_SIZE * sizeof(size_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (nursery.begin == MAP_FAILED) {
+    perror ("EROOR: init_pool: mmap failed\n");
+    exit   (1);
+  }
+  nursery.current = nursery.begin;
+  nursery.end     = nursery.begin + NURSERY_SIZE;
+  nursery.size    = NURSERY_SIZE;
   init_extra_roots ();
 }
 
+/* Resizes the old space in place after a major collection started at start */
+static void adapt_space_size (double start) {
+  double end   = gc_clock ();
+  double ratio = (end - start) / (end - last_gc_end);
+  size_t live  = from_space.current - from_space.begin;
+  size_t size  = from_space.end - from_space.begin;
+  void  *p     = NULL;
+
+  if (ratio > GC_TIME_RATIO_HIGH || 2 * live > size) size = grown_space_size (size);
+  else if (ratio < GC_TIME_RATIO_LOW && 8 * live < size) size = (size_t) (size / SPACE_GROWTH);
+
+  if (size < MIN_SPACE_SIZE) size = MIN_SPACE_SIZE;
+  if (size < live + 2 * NURSERY_SIZE) size = live + 2 * NURSERY_SIZE;
+  size = limited_space_size (size, live + NURSERY_SIZE + 1);
+
+  last_gc_end = end;
+  SPACE_SIZE  = size;
+
+  if (size < (size_t) (from_space.end - from_space.begin)) {
+    release_pool_pages (&from_space, size);
+    release_pool_pages (&to_space, size);
+  }
+  else if (size > from_space.size) {
+    /* Growing fails when the following addresses are taken; then the next
+       to_space gets the new size */
+    p = mremap (from_space.begin, from_space.size * sizeof(size_t), size * sizeof(size_t), 0);
+    if (p == MAP_FAILED) return;
+    from_space.size = size;
+  }
+  from_space.end = from_space.begin + size;
+}
+
+static void* gc_flip (size_t size, double start);
+
 static void* gc (size_t size) {
+  double start = gc_clock ();
+
   if (! enable_GC) {
     Lfailure ("GC disabled");
   }
 
+  gc_counts[MAJOR_GCS]++;
   current = to_space.begin;
 #ifdef DEBUG_PRINT
   print_indent ();
@@ -2040,12 +3832,13 @@ static void* gc (size_t size) {
 	  __gc_stack_top, __gc_stack_bottom);
   fflush (stdout);
 #endif
+  gathering_roots = parallel_gc_enabled ();
   gc_root_scan_data ();
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("gc: data is scanned\n"); fflush (stdout);
 #endif
-  __gc_root_scan_stack ();
+  gc_root_scan_program_stack ();
   for (int i = 0; i < extra_roots.current_free; i++) {
 #ifdef DEBUG_PRINT
     print_indent ();
@@ -2059,6 +3852,29 @@ static void* gc (size_t size) {
   print_indent ();
   printf ("gc: no more extra roots\n"); fflush (stdout);
 #endif
+  if (gathering_roots) {
+    size_t *end = to_space.end;
+
+    /* The threads may copy into all of the mapping, which the space keeps
+       if they went past its end */
+    gathering_roots = 0;
+    to_space.end    = to_space.begin + to_space.size;
+    gc_counts[PARALLEL_GCS]++;
+    parallel_collect ();
+    if (current < end) to_space.end = end;
+  }
+  else gc_scan_all (to_space.begin);
+  sweep_large_objects ();
+
+  return gc_flip (size, start);
+}
+
+/* Makes the copies in to_space up to current the old space, with size words
+   allocated past them */
+static void* gc_flip (size_t size, double start) {
+  /* The survivors of the nursery have been copied along with the old space */
+  reset_nursery ();
+  unremembered_stores = 0;
 
   if (!IN_PASSIVE_SPACE(current)) {
     printf ("gc: ASSERT: !IN_PASSIVE_SPACE(current) to_begin = %p to_end = %p \
@@ -2068,12 +3884,14 @@ static void* gc (size_t size) {
     exit   (1);
   }
 
-  while (current + size >= to_space.end) {
+  while (current + size + NURSERY_SIZE >= to_space.end) {
 #ifdef DEBUG_PRINT
     print_indent ();
     printf ("gc: pre-extend_spaces : %p %zu %p \n", current, size, to_space.end);
     fflush (stdout);
 #endif
+    if (MAX_SPACE_SIZE && (size_t) (to_space.end - to_space.begin) >= MAX_SPACE_SIZE)
+      HEAP_LIMIT_FAILURE ();
     if (extend_spaces ()) {
       gc_swap_spaces ();
       init_to_space (1);
@@ -2086,10 +3904,11 @@ static void* gc (size_t size) {
 #endif
   }
   assert (IN_PASSIVE_SPACE(current));
-  assert (current + size < to_space.end);
+  assert (current + size + NURSERY_SIZE < to_space.end);
 
   gc_swap_spaces ();
   from_space.current = current + size;
+  adapt_space_size (start);
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("gc: end: (allocate!) return %p; from_space.current %p; \
@@ -2101,6 +3920,225 @@ static void* gc (size_t size) {
   return (void *) current;
 }
 
+static void scan_remembered_object (size_t *obj) {
+  data *d = TO_DATA(obj);
+  int   i;
+
+  if (TAG(d->tag) == STRING_TAG) return;
+
+  for (i = 0; i < LEN(d->tag); i++) gc_test_and_copy_root ((size_t**) obj + i);
+}
+
+/* Promotes the survivors of the nursery into the old space, which must have
+   room for all of them */
+static void minor_gc (void) {
+  size_t i;
+
+  gc_counts[MINOR_GCS]++;
+  minor_collection = 1;
+  current = from_space.current;
+
+  gc_root_scan_data ();
+  gc_root_scan_program_stack ();
+  for (i = 0; i < extra_roots.current_free; i++) {
+    gc_test_and_copy_root ((size_t**)extra_roots.roots[i]);
+  }
+  for (i = 0; i < remembered_slots_capacity; i++) {
+    if (remembered_slots[i] != NULL) gc_test_and_copy_root ((size_t**) remembered_slots[i]);
+  }
+  for (i = 0; i < remembered_objects_number; i++) {
+    scan_remembered_object (remembered_objects[i]);
+  }
+  gc_scan (from_space.current);
+
+  from_space.current = current;
+  minor_collection = 0;
+  reset_nursery ();
+}
+
+static void compact_scan_roots (int mode) {
+  int i;
+
+  compact_roots = mode;
+  gc_root_scan_data ();
+  gc_root_scan_program_stack ();
+  for (i = 0; i < extra_roots.current_free; i++) {
+    gc_test_and_copy_root ((size_t**)extra_roots.roots[i]);
+  }
+  compact_roots = 0;
+}
+
+static void init_compact_region (compact_region *r, size_t *begin, size_t *end) {
+  size_t blocks = (end - begin + BLOCK_WORDS - 1) / BLOCK_WORDS + 1;
+
+  r->begin   = begin;
+  r->end     = end;
+  r->headers = calloc (blocks, sizeof (size_t));
+  r->live    = calloc (blocks, sizeof (size_t));
+  r->base    = calloc (blocks, sizeof (size_t*));
+  if (r->headers == NULL || r->live == NULL || r->base == NULL) {
+    perror ("ERROR: init_compact_region: calloc failed\n");
+    exit   (1);
+  }
+}
+
+static void free_compact_region (compact_region *r) {
+  free (r->headers);
+  free (r->live);
+  free (r->base);
+  r->begin = r->end = NULL;
+}
+
+/* Major collection of the mark-compact mode, with size words allocated past
+   the live objects. The old space grows in place if it can, and otherwise
+   the objects are moved into a new mapping of the grown size. */
+static void* compact (size_t size) {
+  double  start = gc_clock ();
+  size_t  words = from_space.end - from_space.begin, needed, b;
+  size_t *dest  = from_space.begin, *old = from_space.begin, *p = NULL;
+  int     relocate = 0;
+
+  if (! enable_GC) {
+    Lfailure ("GC disabled");
+  }
+
+  gc_counts[COMPACTIONS]++;
+  init_compact_region (&compact_regions[0], from_space.begin, from_space.current);
+  init_compact_region (&compact_regions[1], nursery.begin, nursery.current);
+
+  compact_scan_roots (MARK_ROOTS);
+  mark_reachable ();
+
+  needed = size + NURSERY_SIZE + 1;
+  for (b = 0; b * BLOCK_WORDS < (size_t) (nursery.current - nursery.begin); b++)
+    needed += __builtin_popcountl (compact_regions[1].live[b]);
+  for (b = 0; b * BLOCK_WORDS < (size_t) (from_space.current - from_space.begin); b++)
+    needed += __builtin_popcountl (compact_regions[0].live[b]);
+
+  if (needed > words) {
+    while (needed > words) {
+      if (MAX_SPACE_SIZE && words >= MAX_SPACE_SIZE) HEAP_LIMIT_FAILURE ();
+      words = grown_space_size (words);
+    }
+    if (words <= from_space.size ||
+        mremap (from_space.begin, from_space.size * sizeof(size_t), words * sizeof(size_t), 0) != MAP_FAILED) {
+      if (words > from_space.size) from_space.size = words;
+    }
+    else {
+      dest = mmap (NULL, words * sizeof(size_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+      if (dest == MAP_FAILED) {
+        perror ("EROOR: compact: mmap failed\n");
+        exit   (1);
+      }
+      relocate = 1;
+    }
+    from_space.end = from_space.begin + words;
+    SPACE_SIZE     = words;
+  }
+
+  p = compute_bases (&compact_regions[0], dest);
+  p = compute_bases (&compact_regions[1], p);
+
+  compact_scan_roots (UPDATE_ROOTS);
+  for_each_live (&compact_regions[0], update_fields);
+  for_each_live (&compact_regions[1], update_fields);
+  for (b = 0; b < large_objects_number; b++)
+    if (large_objects[b].marked) update_fields (large_objects[b].object);
+  for_each_live (&compact_regions[0], move_object);
+  for_each_live (&compact_regions[1], move_object);
+  sweep_large_objects ();
+
+  free_compact_region (&compact_regions[0]);
+  free_compact_region (&compact_regions[1]);
+  free (mark_stack);
+  mark_stack = NULL;
+  mark_stack_size = mark_stack_capacity = 0;
+
+  if (relocate) {
+    munmap (old, from_space.size * sizeof(size_t));
+    from_space.begin = dest;
+    from_space.end   = dest + words;
+    from_space.size  = words;
+  }
+  reset_nursery ();
+  unremembered_stores = 0;
+
+  from_space.current = p + size;
+  adapt_space_size (start);
+
+  return (void*) p;
+}
+
+static void replicate_roots (int mode) {
+  int i;
+
+  root_replication = mode;
+  gc_root_scan_data ();
+  gc_root_scan_program_stack ();
+  for (i = 0; i < extra_roots.current_free; i++) {
+    gc_test_and_copy_root ((size_t**)extra_roots.roots[i]);
+  }
+  root_replication = 0;
+}
+
+/* Starts an incremental collection once the old space is half full; the
+   nursery must be empty */
+static void start_replicating (void) {
+  if (2 * (from_space.current - from_space.begin) < from_space.end - from_space.begin) return;
+
+  replicating = 1;
+  init_to_space (0);
+  replica_scan = replica_current = to_space.begin;
+  replicate_roots (REPLICATE_ROOTS);
+}
+
+/* Completes the incremental collection and flips the spaces, with size
+   words allocated in the new old space */
+static void* finish_replicating (size_t size) {
+  double  start = gc_clock ();
+  size_t *obj, i;
+
+  gc_counts[INCREMENTAL_FLIPS]++;
+  minor_gc ();
+
+  /* The large objects reached so far, all of their fields this time */
+  redirect_large = 1;
+  for (i = 0; i < large_objects_number; i++)
+    if (large_objects[i].marked) push_large_pending (large_objects[i].object);
+
+  /* The runtime writes the objects it holds in extra roots in bulk, not
+     always through the write barrier */
+  for (i = 0; i < extra_roots.current_free; i++) {
+    obj = *(size_t**)extra_roots.roots[i];
+    if (IS_VALID_HEAP_POINTER(obj)) log_written_object (obj);
+  }
+  update_replicas ();
+
+  replicate_roots (REDIRECT_ROOTS);
+  scan_replicas (0);
+  redirect_large = 0;
+  sweep_large_objects ();
+  current = replica_current;
+  stop_replicating ();
+
+  return gc_flip (size, start);
+}
+
+/* Replicates about GC_INCREMENT words per word allocated since the previous
+   slice; the collection is complete when the replicas are and the roots
+   point to no original without one */
+static void replicate_slice (size_t allocated) {
+  size_t *last = NULL;
+
+  update_replicas ();
+  if (!scan_replicas ((size_t) (GC_INCREMENT * allocated) + 1)) return;
+
+  last = replica_current;
+  replicate_roots (REPLICATE_ROOTS);
+  if (replica_current == last) finish_replicating (0);
+}
+
 #ifdef DEBUG_PRINT
 static void printFromSpace (void) {
   size_t * cur = from_space.begin, *tmp = NULL;
@@ -2190,16 +4228,15 @@ static void printFromSpace (void) {
 #endif
 
 #ifdef __ENABLE_GC__
-// alloc: allocates `size` bytes in heap
-extern void * alloc (size_t size) {
+// old_alloc: allocates `size` words in the old space
+static void * old_alloc (size_t size) {
   void * p = (void*)BOX(NULL);
-  size = (size - 1) / sizeof(size_t) + 1; // convert bytes to words
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
   printf ("alloc: current: %p %zu words!", from_space.current, size);
   fflush (stdout);
 #endif
-  if (from_space.current + size < from_space.end) {
+  if (from_space.current + size + NURSERY_SIZE < from_space.end) {
     p = (void*) from_space.current;
     from_space.current += size;
 #ifdef DEBUG_PRINT
@@ -2210,6 +4247,9 @@ extern void * alloc (size_t size) {
     return p;
   }
 
+  if (mark_compact) return compact (size);
+
+  stop_replicating ();
   init_to_space (0);
 #ifdef DEBUG_PRINT
   print_indent ();
@@ -2226,4 +4266,55 @@ extern void * alloc (size_t size) {
   return gc (size);
 #endif
 }
+
+// alloc: allocates `size` bytes in heap
+extern void * alloc (size_t size) {
+  void * p = NULL;
+  size = (size - 1) / sizeof(size_t) + 1; // convert bytes to words
+
+  if (size <= NURSERY_OBJECT_SIZE && nursery.current + size <= nursery.end) {
+    p = (void*) nursery.current;
+    nursery.current += size;
+    return p;
+  }
+
+  // Constructors fill their objects without write barriers, which only
+  // matters for those allocated in the old space
+  if (! enable_GC) {
+    unremembered_stores = 1;
+    return old_alloc (size);
+  }
+
+  // A big object needs no collection unless it is the turn of a major one;
+  // its constructor remembers it
+  if (size > NURSERY_OBJECT_SIZE && !unremembered_stores &&
+      large_words_allocated + size <= (size_t) (from_space.end - from_space.begin))
+    return large_alloc (size);
+
+  if (unremembered_stores ||
+      from_space.current + (nursery.current - nursery.begin) + NURSERY_SIZE >= from_space.end ||
+      large_words_allocated > (size_t) (from_space.end - from_space.begin)) {
+    // A minor collection would miss the unremembered young pointers
+    if (mark_compact) compact (0);
+    else if (replicating && !unremembered_stores) finish_replicating (0);
+    else {
+      stop_replicating ();
+      init_to_space (0);
+      gc (0);
+    }
+  }
+  else {
+    size_t allocated = nursery.current - nursery.begin;
+
+    minor_gc ();
+    if (replicating) replicate_slice (allocated);
+    else if (GC_INCREMENT > 0 && !mark_compact) start_replicating ();
+  }
+
+  if (size > NURSERY_OBJECT_SIZE) return large_alloc (size);
+
+  p = (void*) nursery.current;
+  nursery.current += size;
+  return p;
+}
 # endif
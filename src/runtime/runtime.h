@@ -13,9 +13,40 @@
 # include <time.h>
 # include <limits.h>
 # include <ctype.h>
+# include <pthread.h>
+# include <sched.h>
 
 # define WORD_SIZE (CHAR_BIT * sizeof(int))
 
 void failure (char *s, ...);
 
+/* Write barrier of the collectors, to be called after storing v into slot,
+   which may be a field of the heap object obj; obj is NULL if not known */
+void gc_write_barrier (void *obj, void *slot, void *v);
+
+/* Makes the next minor collection scan all the fields of obj, after bulk
+   stores into it */
+void gc_remember_object (void *obj);
+
+/* Copies the object *root points to, if the running collection moves it, and
+   updates *root */
+void gc_test_and_copy_root (size_t **root);
+
+/* Sets the function passing the roots on the program stack to
+   gc_test_and_copy_root, in place of the conservative scan of the words
+   from __gc_stack_top to __gc_stack_bottom */
+void gc_set_stack_root_scanner (void (*scanner) (void));
+
+/* GC pool structure */
+typedef struct {
+  size_t * begin;
+  size_t * end;
+  size_t * current;
+  size_t   size;
+} pool;
+
+/* The nursery objects are allocated in. Small objects may be allocated
+   inline by bumping current up to end, with alloc as the slow path */
+extern pool nursery;
+
 # endif